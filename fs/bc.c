@@ -24,6 +24,72 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// The blocks in the cache, at most BC_NPAGES, in CLOCK order.
+// A slot holding 0 is free.  BC_LOADING marks a block that has its
+// slot but is still being read in, and may not be mapped yet.
+static uint32_t bc_blocks[BC_NPAGES];
+static uint32_t bc_hand;	// Next slot bc_slot looks at
+static uint32_t bc_nevicted;	// Blocks bc_slot has evicted
+#define BC_LOADING	0x80000000
+
+// Blocks 0 and 1 and the bitmap blocks are never evicted: bc_pgfault
+// reads the superblock and the bitmap, and must not fault on them.
+static bool
+bc_pinned(uint32_t blockno)
+{
+	if (blockno <= 1)
+		return 1;
+	// The superblock is pinned, and read in, by the time bitmap is set.
+	return bitmap && blockno < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Find a slot for block 'blockno', about to be read into the cache,
+// evicting a block if the cache is full, and claim it for 'blockno'
+// marked BC_LOADING; the caller clears the mark once the block is
+// mapped.  CLOCK: sweep the slots from bc_hand, giving blocks whose
+// PTE_A is set a second chance, and clearing it by remapping their page
+// (after flushing them, if dirty, since the remap clears PTE_D as
+// well); the first block found without PTE_A is flushed and unmapped.
+// A pointer into an evicted block is still good: the next access faults
+// the block back in from disk.
+// Returns the slot's index.
+static uint32_t
+bc_slot(uint32_t blockno)
+{
+	uint32_t i;
+	void *addr;
+	int r;
+
+	for (;;) {
+		i = bc_hand;
+		bc_hand = (bc_hand + 1) % BC_NPAGES;
+		if (bc_blocks[i] == 0)
+			break;
+		if (bc_blocks[i] & BC_LOADING)
+			continue;
+		// Not diskaddr, which reads the superblock: we can't fault here.
+		addr = (void *) (DISKMAP + bc_blocks[i] * BLKSIZE);
+		if (!va_is_mapped(addr))
+			break;
+		if (bc_pinned(bc_blocks[i]))
+			continue;
+		if (uvpt[PGNUM(addr)] & PTE_A) {
+			if (va_is_dirty(addr))
+				flush_block(addr);
+			else if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+				panic("in bc_slot, sys_page_map: %e", r);
+			continue;
+		}
+		flush_block(addr);
+		if ((r = sys_page_unmap(0, addr)) < 0)
+			panic("in bc_slot, sys_page_unmap: %e", r);
+		bc_nevicted++;
+		break;
+	}
+	bc_blocks[i] = blockno | BC_LOADING;
+	return i;
+}
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
 static void
@@ -31,6 +97,7 @@ bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	uint32_t slot;
 	int r;
 
 	// Check that the fault was within the block cache region
@@ -49,6 +116,7 @@ bc_pgfault(struct UTrapframe *utf)
 	//
 	// LAB 5: you code here:
 	addr = ROUNDDOWN(addr,BLKSIZE);
+	slot = bc_slot(blockno);
 	//step 1: allocate page in rnd_addr
 	r = sys_page_alloc(0, addr,PTE_U | PTE_P | PTE_W);
 	if (r < 0) panic("Error in bc_pgfault: not maspik memory r is {%d}\n",r);
@@ -61,6 +129,7 @@ bc_pgfault(struct UTrapframe *utf)
 	// block from disk
 	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
 		panic("in bc_pgfault, sys_page_map: %e", r);
+	bc_blocks[slot] = blockno;	// loaded
 
 	// Check that the block we read was allocated. (exercise for
 	// the reader: why do we do this *after* reading the block
@@ -100,6 +169,106 @@ flush_block(void *addr)
 
 }
 
+// Make sure the block containing VA is in the cache, reading it in if
+// it isn't.  Pages sent to clients must be mapped (see serve_read_map).
+void
+bc_load(void *addr)
+{
+	if (!va_is_mapped(addr))
+		(void) *(volatile char *) addr;
+}
+
+// Make sure all 'n' blocks at 'addrs' are in the cache at once.
+// Reading one in may evict another, so go until none is missing.
+void
+bc_load_all(void **addrs, size_t n)
+{
+	size_t i;
+
+	assert(n <= BC_NPAGES / 2);
+again:
+	for (i = 0; i < n; i++)
+		bc_load(addrs[i]);
+	for (i = 0; i < n; i++)
+		if (!va_is_mapped(addrs[i]))
+			goto again;
+}
+
+// Read the 'nblocks' blocks from 'blockno' on, none of which may be
+// cached yet, into the block cache with one multi-sector IDE command,
+// rather than one bc_pgfault, page allocation and IDE command each.
+void
+bc_readahead(uint32_t blockno, uint32_t nblocks)
+{
+	char *addr = diskaddr(blockno);
+	uint32_t i, slots[BC_READAHEAD_MAX];
+	int r;
+
+	assert(nblocks > 0 && nblocks <= BC_READAHEAD_MAX);
+	diskaddr(blockno + nblocks - 1);	// check the last block too
+
+	for (i = 0; i < nblocks; i++)
+		slots[i] = bc_slot(blockno + i);
+
+	for (i = 0; i < nblocks; i++)
+		if ((r = page_batch_alloc(0, addr + i * BLKSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_readahead, sys_page_alloc: %e", r);
+	if ((r = page_batch_flush()) < 0)
+		panic("in bc_readahead, sys_page_alloc: %e", r);
+
+	if ((r = ide_read(blockno * BLKSECTS, addr, nblocks * BLKSECTS)) < 0)
+		panic("in bc_readahead, ide_read: %e", r);
+
+	// Clear the dirty bits, as bc_pgfault does.
+	for (i = 0; i < nblocks; i++)
+		if ((r = page_batch_map(0, addr + i * BLKSIZE, 0, addr + i * BLKSIZE,
+					uvpt[PGNUM(addr + i * BLKSIZE)] & PTE_SYSCALL)) < 0)
+			panic("in bc_readahead, sys_page_map: %e", r);
+	if ((r = page_batch_flush()) < 0)
+		panic("in bc_readahead, sys_page_map: %e", r);
+	for (i = 0; i < nblocks; i++)
+		bc_blocks[slots[i]] = blockno + i;	// loaded
+}
+
+// Report the block cache's size, occupancy and evictions in 'st'.
+void
+bc_stat(struct Fsret_cache_stat *st)
+{
+	uint32_t i;
+
+	st->ret_npages = BC_NPAGES;
+	st->ret_ncached = 0;
+	for (i = 0; i < BC_NPAGES; i++)
+		if (bc_blocks[i] != 0 && !(bc_blocks[i] & BC_LOADING)
+		    && va_is_mapped((void *) (DISKMAP + bc_blocks[i] * BLKSIZE)))
+			st->ret_ncached++;
+	st->ret_nevicted = bc_nevicted;
+}
+
+// Give the file system a private copy of the cached block containing
+// VA if a client also maps it (serve_read_map sends clients block cache
+// pages copy-on-write), so that writing to the block doesn't change the
+// client's page.  Call this before any write to a block.
+void
+bc_unshare(void *addr)
+{
+	int r;
+
+	addr = ROUNDDOWN(addr, BLKSIZE);
+	if (!va_is_mapped(addr) || pageref(addr) <= 1)
+		return;
+
+	// The copy starts out clean, so write back any changes first.
+	flush_block(addr);
+	if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("in bc_unshare, sys_page_alloc: %e", r);
+	memmove(UTEMP, addr, BLKSIZE);
+	if ((r = sys_page_map(0, UTEMP, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+		panic("in bc_unshare, sys_page_map: %e", r);
+	if ((r = sys_page_unmap(0, UTEMP)) < 0)
+		panic("in bc_unshare, sys_page_unmap: %e", r);
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
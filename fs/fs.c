@@ -71,6 +71,8 @@ alloc_block(void)
 			//Mark as not-free
 			bitmap[blockno/32] &= (~(1<<(blockno%32)));
 			flush_block(&bitmap[blockno/32]);
+			// A client may still map the block's old contents.
+			bc_unshare(diskaddr(blockno));
 			return blockno;
 		}
 	}
@@ -149,7 +151,7 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
        if(filebno >= NDIRECT + NINDIRECT) return -E_INVAL;
 			 int res;
 			//if(filebno > NDIRECT && !f_indirect && !alloc) return -E_NOT_FOUND;
-			 if(filebno <= NDIRECT)
+			 if(filebno < NDIRECT)
 			 {
 				 	*ppdiskbno = &(f->f_direct[filebno]);
 			 }
@@ -198,6 +200,37 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 		return 0;
 }
 
+// Read blocks filebno through filebno+nblocks-1 of 'f' into the block
+// cache ahead of use.  Blocks that are cached already, unallocated or
+// past the end of the file are skipped, and each run of blocks that
+// are consecutive on disk is read with one IDE command (see
+// bc_readahead).
+void
+file_readahead(struct File *f, uint32_t filebno, uint32_t nblocks)
+{
+	uint32_t *pdiskbno, blockno, start = 0, n = 0, end;
+
+	end = MIN(filebno + nblocks, ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE);
+	for (; filebno < end; filebno++) {
+		if (file_block_walk(f, filebno, &pdiskbno, 0) < 0 || *pdiskbno == 0
+		    || va_is_mapped(diskaddr(*pdiskbno)))
+			blockno = 0;
+		else
+			blockno = *pdiskbno;
+		if (n > 0 && (blockno != start + n || n == BC_READAHEAD_MAX)) {
+			bc_readahead(start, n);
+			n = 0;
+		}
+		if (blockno) {
+			if (n == 0)
+				start = blockno;
+			n++;
+		}
+	}
+	if (n > 0)
+		bc_readahead(start, n);
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
@@ -405,6 +438,7 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		bc_unshare(blk);
 		memmove(blk + pos % BLKSIZE, buf, bn);
 		pos += bn;
 		buf += bn;
@@ -490,6 +524,24 @@ file_flush(struct File *f)
 }
 
 
+// Remove a file: free its blocks and its directory entry.
+int
+file_remove(const char *path)
+{
+	int r;
+	struct File *f;
+
+	if ((r = walk_path(path, 0, &f, 0)) < 0)
+		return r;
+
+	file_truncate_blocks(f, 0);
+	f->f_name[0] = '\0';
+	f->f_size = 0;
+	flush_block(f);
+
+	return 0;
+}
+
 // Sync the entire file system.  A big hammer.
 void
 fs_sync(void)
@@ -4,6 +4,14 @@
 #define SECTSIZE	512			// bytes per disk sector
 #define BLKSECTS	(BLKSIZE / SECTSIZE)	// sectors per block
 
+/* Most blocks bc_readahead reads at once: one IDE command's worth. */
+#define BC_READAHEAD_MAX	(256 / BLKSECTS)
+
+/* Most blocks the block cache keeps in memory (2MB); beyond that, bc.c
+ * evicts blocks to make room.  Trades the FS server's memory for fewer
+ * disk reads. */
+#define BC_NPAGES		512
+
 /* Disk block n, when in memory, is mapped into the file system
  * server's address space at DISKMAP + (n*BLKSIZE). */
 #define DISKMAP		0x10000000
@@ -26,11 +34,17 @@ void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_unshare(void *addr);
+void	bc_load(void *addr);
+void	bc_load_all(void **addrs, size_t n);
+void	bc_readahead(uint32_t blockno, uint32_t nblocks);
+void	bc_stat(struct Fsret_cache_stat *st);
 void	bc_init(void);
 
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+void	file_readahead(struct File *f, uint32_t filebno, uint32_t nblocks);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
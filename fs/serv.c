@@ -34,8 +34,15 @@ struct OpenFile {
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	uint32_t o_ra_next;	// Block a sequential read would start in
+	uint32_t o_ra_end;	// Block after the last one read ahead
+	uint32_t o_ra_window;	// Blocks to read ahead, 0 after a seek
 };
 
+// Read-ahead window bounds, in blocks (see serve_readahead).
+#define RA_MIN		4
+#define RA_MAX		BC_READAHEAD_MAX
+
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
 #define FILEVA		0xD0000000
@@ -46,7 +53,8 @@ struct OpenFile opentab[MAXOPEN] = {
 };
 
 // Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Requests arrive here, followed by up to IPC_MAXPAGES - 1 data pages.
+union Fsipc *fsreq = (union Fsipc *)(DISKMAP - IPC_MAXPAGES * PGSIZE);
 
 void
 serve_init(void)
@@ -75,6 +83,9 @@ openfile_alloc(struct OpenFile **o)
 			/* fall through */
 		case 1:
 			opentab[i].o_fileid += MAXOPEN;
+			opentab[i].o_ra_next = 0;
+			opentab[i].o_ra_end = 0;
+			opentab[i].o_ra_window = 0;
 			*o = &opentab[i];
 			memset(opentab[i].o_fd, 0, PGSIZE);
 			return (*o)->o_fileid;
@@ -200,6 +211,37 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 	return file_set_size(o->o_file, req->req_size);
 }
 
+// Called before reading 'n' bytes of o's file at 'offset'.  Reads that
+// pick up in the block where the last one ended are sequential: each
+// doubles o's read-ahead window, up to RA_MAX blocks, and any other read
+// closes it.  When a sequential read goes past the blocks read ahead so
+// far, read its blocks and a window's worth more into the block cache
+// in as few IDE commands as possible (see file_readahead), rather than
+// faulting them in one at a time.
+static void
+serve_readahead(struct OpenFile *o, off_t offset, size_t n)
+{
+	uint32_t bno, last;
+
+	if (n == 0 || offset >= o->o_file->f_size)
+		return;
+	bno = offset / BLKSIZE;
+	last = (MIN(offset + n, o->o_file->f_size) - 1) / BLKSIZE;
+
+	if (o->o_ra_next == bno || o->o_ra_next == bno + 1)
+		o->o_ra_window = MIN(MAX(o->o_ra_window * 2, RA_MIN), RA_MAX);
+	else {
+		o->o_ra_window = 0;
+		o->o_ra_end = 0;
+	}
+	o->o_ra_next = last + 1;
+
+	if (o->o_ra_window && last >= o->o_ra_end) {
+		file_readahead(o->o_file, bno, last + 1 + o->o_ra_window - bno);
+		o->o_ra_end = last + 1 + o->o_ra_window;
+	}
+}
+
 // Read at most ipc->read.req_n bytes from the current seek position
 // in ipc->read.req_fileid.  Return the bytes read from the file to
 // the caller in ipc->readRet, then update the seek position.  Returns
@@ -219,7 +261,9 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
-	if ((r = file_read(o->o_file, ret->ret_buf, req->req_n, o->o_fd->fd_offset)) < 0)
+	serve_readahead(o, o->o_fd->fd_offset, MIN(req->req_n, PGSIZE));
+	if ((r = file_read(o->o_file, ret->ret_buf, MIN(req->req_n, PGSIZE),
+			   o->o_fd->fd_offset)) < 0)
 	  return r;
 
 	o->o_fd->fd_offset += r;
@@ -227,6 +271,97 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	return r;
 }
 
+// Like serve_read, but when the seek position is block-aligned and
+// whole blocks of the file lie ahead of it, send the caller the block
+// cache pages themselves, read-only and copy-on-write, instead of
+// copying into ipc->readRet: as many whole blocks as fit in req_n, up
+// to IPC_MAXPAGES.  Stores the pages in pgs, and sets *npages_store and
+// *perm_store, when pages are sent.
+// The file system makes itself a private copy of a block before it next
+// writes to it (see bc_unshare), so the caller's mapping never changes.
+// Returns the number of bytes read, or < 0 on error.
+int
+serve_read_map(envid_t envid, union Fsipc *ipc, void **pgs,
+	       size_t *npages_store, int *perm_store)
+{
+	struct Fsreq_read *req = &ipc->read;
+	struct OpenFile *o;
+	off_t offset;
+	size_t i, n;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_map %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+
+	offset = o->o_fd->fd_offset;
+	if (o->o_file->f_type != FTYPE_REG || offset % BLKSIZE != 0
+	    || req->req_n < BLKSIZE || offset + BLKSIZE > o->o_file->f_size)
+		return serve_read(envid, ipc);
+
+	n = MIN(req->req_n, o->o_file->f_size - offset) / BLKSIZE;
+	n = MIN(n, IPC_MAXPAGES);
+	serve_readahead(o, offset, n * BLKSIZE);
+	for (i = 0; i < n; i++) {
+		if ((r = file_get_block(o->o_file, offset / BLKSIZE + i, &blk)) < 0)
+			return r;
+		pgs[i] = blk;
+	}
+	bc_load_all(pgs, n);
+	*npages_store = n;
+	*perm_store = PTE_P | PTE_U | PTE_COW;
+	o->o_fd->fd_offset += n * BLKSIZE;
+	return n * BLKSIZE;
+}
+
+// Send the caller the block cache page holding the block of
+// req->req_fileid at req->req_offset, for mmap.  req_perm is PTE_P|PTE_U,
+// optionally with PTE_W for a private copy-on-write mapping; the caller
+// never gets a page it can write through to the cache.  Bytes past the
+// end of the file in its last block are zeroed first.
+// Sets *pg_store and *perm_store, and returns 0 on success, < 0 on error.
+int
+serve_map(envid_t envid, struct Fsreq_map *req, void **pg_store,
+	  int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int r, n, i;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+
+	if (o->o_file->f_type != FTYPE_REG || req->req_offset < 0
+	    || req->req_offset % BLKSIZE != 0
+	    || req->req_offset >= o->o_file->f_size
+	    || (req->req_perm & ~(PTE_P|PTE_U|PTE_W)) != 0)
+		return -E_INVAL;
+
+	if ((r = file_get_block(o->o_file, req->req_offset / BLKSIZE, &blk)) < 0)
+		return r;
+	bc_load(blk);
+
+	if ((n = o->o_file->f_size - req->req_offset) < BLKSIZE) {
+		for (i = n; i < BLKSIZE && blk[i] == 0; i++)
+			;
+		if (i < BLKSIZE) {
+			bc_unshare(blk);
+			memset(blk + n, 0, BLKSIZE - n);
+		}
+	}
+
+	*pg_store = blk;
+	*perm_store = PTE_P | PTE_U;
+	if (req->req_perm & PTE_W)
+		*perm_store |= PTE_COW;
+	return 0;
+}
 
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
@@ -252,6 +387,34 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	return r;
 }
 
+// Write req->req_n bytes to req_fileid at the current seek position,
+// like serve_write, but from the 'npages' pages at 'data' that came
+// with the request, starting req->req_pgoff bytes into the first.
+// Returns the number of bytes written, or < 0 on error.
+int
+serve_writev(envid_t envid, struct Fsreq_writev *req, const char *data,
+	     size_t npages)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_writev %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_pgoff >= PGSIZE || req->req_n > npages * PGSIZE
+	    || req->req_pgoff + req->req_n > npages * PGSIZE)
+		return -E_INVAL;
+
+	if ((r = file_write(o->o_file, data + req->req_pgoff, req->req_n,
+			    o->o_fd->fd_offset)) < 0)
+		return r;
+
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
 // caller in ipc->statRet.
 int
@@ -290,6 +453,21 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 	return 0;
 }
 
+// Remove the file named req->req_path.  This request doesn't refer to
+// an open file.
+int
+serve_remove(envid_t envid, struct Fsreq_remove *req)
+{
+	char path[MAXPATHLEN];
+
+	if (debug)
+		cprintf("serve_remove %08x %s\n", envid, req->req_path);
+
+	// Copy in the path, making sure it's null-terminated
+	memmove(path, req->req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+	return file_remove(path);
+}
 
 int
 serve_sync(envid_t envid, union Fsipc *req)
@@ -298,17 +476,35 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Return the block cache's statistics to the caller in
+// ipc->cacheStatRet.
+int
+serve_cache_stat(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_cache_stat %08x\n", envid);
+
+	bc_stat(&ipc->cacheStatRet);
+	return 0;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open, read-map, map and write-vector are handled specially
+	// because they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
+	/* [FSREQ_READ_MAP] =	(fshandler)serve_read_map, */
+	/* [FSREQ_MAP] =	(fshandler)serve_map, */
+	/* [FSREQ_WRITEV] =	(fshandler)serve_writev, */
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_REMOVE] =	(fshandler)serve_remove,
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_CACHE_STAT] =	serve_cache_stat
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
@@ -317,11 +513,13 @@ serve(void)
 {
 	uint32_t req, whom;
 	int perm, r;
-	void *pg;
+	void *pg, *pgs[IPC_MAXPAGES];
+	size_t i, nrecv, npgs;
 
 	while (1) {
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		req = ipc_recvv((int32_t *) &whom, fsreq, IPC_MAXPAGES, &perm,
+				&nrecv);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
@@ -334,16 +532,29 @@ serve(void)
 		}
 
 		pg = NULL;
+		npgs = 0;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_READ_MAP) {
+			r = serve_read_map(whom, fsreq, pgs, &npgs, &perm);
+		} else if (req == FSREQ_WRITEV) {
+			r = serve_writev(whom, &fsreq->writev,
+					 (char *) fsreq + PGSIZE, nrecv - 1);
+		} else if (req == FSREQ_MAP) {
+			r = serve_map(whom, (struct Fsreq_map*)fsreq, &pg, &perm);
 		} else if (req < NHANDLERS && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		if (npgs > 0)
+			ipc_sendv(whom, r, pgs, npgs, perm);
+		else
+			ipc_send(whom, r, pg, perm);
+		for (i = 0; i < nrecv; i++)
+			page_batch_unmap(0, (char *) fsreq + i * PGSIZE);
+		page_batch_flush();
 	}
 }
 
@@ -41,6 +41,26 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Scheduling priorities (Env->env_priority).  A runnable env is
+// never passed over in favor of one with a lower priority.
+enum {
+	ENV_PRIO_LOW = 0,
+	ENV_PRIO_NORMAL,
+	ENV_PRIO_SERVER,	// Reserved for the fs and ns servers
+	NENVPRIO
+};
+
+// Scheduling weights (Env->env_weight): the number of timer ticks an
+// env may run before it is preempted in favor of an equal-priority env.
+#define ENV_WEIGHT_DEFAULT	1
+#define ENV_WEIGHT_MAX		16
+
+// Number of pages user_mem_check remembers per env (Env->env_umem_cache).
+#define UMEM_CACHE_SIZE		8
+
+// Most pages one vectored IPC can carry (see sys_ipc_sendv).
+#define IPC_MAXPAGES		64
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -69,8 +89,19 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Scheduling
+	struct Env *env_rq_link;	// Next env on a CPU ready queue
+	bool env_rq_queued;		// Env is linked on a ready queue
+	int env_priority;		// ENV_PRIO_*
+	uint32_t env_weight;		// Timer ticks per time slice
+	uint32_t env_slice;		// Ticks left in the current slice
+	uint32_t env_sleep_until;	// time_msec() to wake up at
+	int env_sleep_idx;		// Position on the sleep heap, 0 if none
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	uintptr_t env_umem_cache[UMEM_CACHE_SIZE]; // Checked pages | perm
+	uint32_t env_umem_gen;		// env_pgdir's pp_umem_gen it is valid for
 
 	// Exception handling
 	void *env_upcalls[16];	// Page fault upcall entry point
@@ -81,6 +112,20 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	size_t env_ipc_npages;		// Pages we can receive, then received
+	struct Env *env_ipc_senders;	// Envs blocked in sys_ipc_send to us
+	struct Env *env_ipc_senders_tail; // Last of them
+	struct Env *env_ipc_send_link;	// Next env on the same sender queue
+	struct Env *env_ipc_send_to;	// Env we are blocked sending to
+	uint32_t env_ipc_send_value;	// Our blocked send's arguments
+	void *env_ipc_send_srcva;
+	unsigned env_ipc_send_perm;
+	size_t env_ipc_send_npages;	// Pages of our blocked sys_ipc_sendv,
+	struct PageInfo *env_ipc_send_pages[IPC_MAXPAGES]; // held until sent
+
+	// Shared-memory rings (see inc/ring.h)
+	bool env_doorbell_waiting;	// Env is blocked in sys_doorbell_wait
+	bool env_doorbell;		// Doorbell rung while not waiting
 
 	bool e1000_waiting;     // is waiting for tx/rx
 	// Classifier Fields
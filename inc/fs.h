@@ -70,7 +70,18 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Read-map takes a Fsreq_read and returns as many whole blocks as
+	// fit in req_n as copy-on-write pages, or a Fsret_read like FSREQ_READ
+	FSREQ_READ_MAP,
+	// Map returns the block at req_offset as a page, read-only or
+	// copy-on-write, and leaves the seek position alone
+	FSREQ_MAP,
+	// Write-vector takes a Fsreq_writev followed by the data's pages,
+	// all in one vectored IPC
+	FSREQ_WRITEV,
+	// Cache-stat returns a Fsret_cache_stat on the request page
+	FSREQ_CACHE_STAT
 };
 
 union Fsipc {
@@ -108,6 +119,21 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+		int req_perm;
+	} map;
+	struct Fsreq_writev {
+		int req_fileid;
+		size_t req_n;
+		size_t req_pgoff;	// Offset of the data in its first page
+	} writev;
+	struct Fsret_cache_stat {
+		uint32_t ret_npages;	// Most blocks the cache holds at once
+		uint32_t ret_ncached;	// Blocks in the cache now
+		uint32_t ret_nevicted;	// Blocks evicted since boot
+	} cacheStatRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
@@ -22,6 +22,7 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/ring.h>
 
 #define USED(x)		(void)(x)
 
@@ -56,14 +57,25 @@ int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int	sys_env_set_upcall(envid_t env, uint32_t trapno, void *upcall);
+int	sys_env_set_priority(envid_t env, int priority, uint32_t weight);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_batch(const struct PageOp *ops, int n);
+envid_t	sys_fork(void);
+int	sys_page_alloc_large(envid_t env, void *va, int perm);
+int	sys_doorbell_wait(void);
+int	sys_doorbell_ring(void *ring);
+int	sys_ring_register(void *ring, envid_t peer);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_sendv(envid_t to_env, uint32_t value, void **pgs, size_t npages, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recvv(void *rcv_pg, size_t npages);
 int sys_send_packet(void *srcva, size_t len);
 int sys_recv_packet(void *srcva, size_t *len_store);
+int sys_try_recv_packet(void *srcva, size_t *len_store);
 void sys_get_macaddr(uint64_t *addr_store);
 /* Net Classifier */
 int sys_set_net_classifier(int8_t * vector);
@@ -73,6 +85,7 @@ int sys_add_to_blacklist(uint32_t mac_addr);
 int sys_report_bad_packet(char* packet,bool label);
 
 unsigned int sys_time_msec(void);
+int	sys_sleep_until(unsigned int msec);
 
 envid_t sys_exec(void * binary, const char **argv);
 
@@ -90,16 +103,44 @@ sys_exofork(void)
 	return ret;
 }
 
+// The PTE for page number 'pn', as seen through uvpt.  A 4MB page
+// (see sys_page_alloc_large) has no page table for uvpt to show, so
+// its page directory entry, which has the same permission bits, is
+// returned instead.  The page table must be present.
+static __inline pte_t
+uvpte(unsigned pn)
+{
+	pde_t pde = uvpd[pn / NPTENTRIES];
+
+	return (pde & PTE_PS) ? pde : uvpt[pn];
+}
+
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+void	ipc_sendv(envid_t to_env, uint32_t value, void **pgs, size_t npages, int perm);
+int32_t ipc_recvv(envid_t *from_env_store, void *pg, size_t npages, int *perm_store, size_t *npages_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
+envid_t	ufork(void);
 envid_t	sfork(void);	// Challenge!
 
+// pagebatch.c
+int	page_batch_alloc(envid_t env, void *pg, int perm);
+int	page_batch_map(envid_t src_env, void *src_pg,
+		       envid_t dst_env, void *dst_pg, int perm);
+int	page_batch_unmap(envid_t env, void *pg);
+int	page_batch_flush(void);
+
+// ring.c
+int	ring_alloc(struct Ring *r);
+int	ring_connect(struct Ring *r, envid_t peer);
+int	ring_share(struct Ring *r, envid_t peer, void *peerva);
+void	ring_push(struct Ring *r, const struct RingDesc *d);
+void	ring_pop(struct Ring *r, struct RingDesc *d);
+
 // fd.c
 int	close(int fd);
 ssize_t	read(int fd, void *buf, size_t nbytes);
@@ -116,6 +157,12 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fs_cache_stat(struct Fsret_cache_stat *st);
+int	file_map(int fdnum, off_t offset, void *dstva, int perm);
+
+// mmap.c
+int	mmap(void *va, size_t len, int perm, int fdnum, off_t offset);
+int	munmap(void *va);
 
 // pageref.c
 int	pageref(void *addr);
@@ -185,6 +185,18 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator state (see kern/pmap.c).  While this page heads a
+	// free block, pp_buddy is 1 + the block's order and pp_prev is the
+	// previous block on its free list; otherwise pp_buddy is 0.
+	uint16_t pp_buddy;
+	union {
+		struct PageInfo *pp_prev;
+		// While the page is an env's page directory: bumped whenever
+		// one of its user mappings may have narrowed (see
+		// user_mem_check).
+		uint32_t pp_umem_gen;
+	};
 };
 
 #endif /* !__ASSEMBLER__ */
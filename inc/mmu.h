@@ -65,10 +65,22 @@
 #define PTE_PS		0x080	// Page Size
 #define PTE_G		0x100	// Global
 
-// The PTE_AVAIL bits aren't used by the kernel or interpreted by the
-// hardware, so user processes are allowed to set them arbitrarily.
+// The PTE_AVAIL bits aren't interpreted by the hardware, so user
+// processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// PTE_AVAIL bits that JOS gives a meaning to.  The kernel resolves write
+// faults on PTE_COW pages itself; fork and spawn share PTE_SHARE pages
+// between parent and child rather than copying them.
+#define PTE_SHARE	0x400	// Shared between parent and child
+#define PTE_COW		0x800	// Copy-on-write
+
+// A page table entry without PTE_P is ignored by the hardware, so JOS
+// marks pages reserved with sys_page_alloc(..., perm | PTE_LAZY) by
+// keeping their permissions in the entry along with PTE_LAZY.  The kernel
+// allocates a zeroed page when one is first touched.
+#define PTE_LAZY	0x080	// Reserved, allocated on first touch (!PTE_P)
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -89,6 +101,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -0,0 +1,33 @@
+// See COPYRIGHT for copyright information.
+
+#ifndef JOS_INC_RING_H
+#define JOS_INC_RING_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// A single-producer, single-consumer ring of descriptors in a page
+// shared between two environments (see lib/ring.c).  The producer only
+// writes r_head and the consumer only writes r_tail, so neither needs a
+// lock or a system call while the ring is neither empty nor full.  A
+// side that finds the ring empty (or full) sets its waiting flag and
+// sleeps in sys_doorbell_wait until the other side rings its doorbell.
+// The kernel knows the ring's two envs (see sys_ring_register), and lets
+// only them ring each other's doorbell through it.
+
+#define RING_SIZE	128		// Descriptors per ring; a power of 2
+
+struct RingDesc {
+	uint32_t rd_value;
+	uint32_t rd_arg[3];
+};
+
+struct Ring {
+	volatile uint32_t r_head;	// Slots filled, ever; producer only
+	volatile uint32_t r_tail;	// Slots emptied, ever; consumer only
+	volatile uint32_t r_cons_waiting; // Consumer sleeps on an empty ring
+	volatile uint32_t r_prod_waiting; // Producer sleeps on a full ring
+	struct RingDesc r_desc[RING_SIZE];
+};
+
+#endif	// !JOS_INC_RING_H
@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/env.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -28,7 +30,34 @@ enum {
 	SYS_add_to_blacklist,
 	SYS_system_net_classifier_switch,
 	SYS_report_bad_packet,
+	SYS_env_set_priority,
+	SYS_sleep_until,
+	SYS_page_batch,
+	SYS_fork,
+	SYS_page_alloc_large,
+	SYS_doorbell_wait,
+	SYS_doorbell_ring,
+	SYS_ipc_send,
+	SYS_ipc_sendv,
+	SYS_ring_register,
 	NSYSCALLS
 };
 
+// Operations for SYS_page_batch.  Each one takes the arguments of, and is
+// checked exactly like, the system call named beside it.
+enum {
+	PAGEOP_ALLOC = 0,	// sys_page_alloc(envid, va, perm)
+	PAGEOP_MAP,		// sys_page_map(envid, va, dstenvid, dstva, perm)
+	PAGEOP_UNMAP,		// sys_page_unmap(envid, va)
+};
+
+struct PageOp {
+	int op;
+	envid_t envid;
+	void *va;
+	envid_t dstenvid;
+	void *dstva;
+	int perm;
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
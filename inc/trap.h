@@ -27,6 +27,9 @@
 // These are arbitrarily chosen, but with care not to overlap
 // processor defined exceptions or interrupt vectors.
 #define T_SYSCALL   48		// system call
+#define T_WAKEUP    49		// IPI that wakes a halted CPU
+#define T_SYSENTER  50		// system call made with sysenter
+				// (marks the Trapframe; not an IDT vector)
 #define T_DEFAULT   500		// catchall
 
 #define IRQ_OFFSET	32	// IRQ 0 corresponds to int IRQ_OFFSET
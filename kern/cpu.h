@@ -23,6 +23,19 @@ struct CpuInfo {
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	bool cpu_kernel_locked;         // Holding the big kernel lock?
+
+	// Ready queues of ENV_RUNNABLE envs waiting for this CPU, one
+	// per priority (linked by Env->env_rq_link).  See kern/sched.c.
+	struct Env *cpu_rq_head[NENVPRIO];
+	struct Env *cpu_rq_tail[NENVPRIO];
+	uint32_t cpu_rq_len;            // Number of envs on all ready queues
+	uint64_t cpu_tick_end;          // time_usec() when curenv's tick ends
+
+	// Free pages kept for this CPU's page_alloc (linked by pp_link).
+	// See kern/pmap.c.
+	struct PageInfo *cpu_free_pages;
+	uint32_t cpu_nfree_pages;
 };
 
 // Initialized in mpconfig.c
@@ -42,5 +55,7 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
+void lapic_timer_oneshot(uint32_t us);
 
 #endif
@@ -4,17 +4,22 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/env.h>
+#include <kern/spinlock.h>
 #include <inc/string.h>
 
 // LAB 6: Your driver code here
 
 volatile void *e1000addr;
-struct e1000_tx_desc txd_arr[E1000_TXDARR_LEN] __attribute__((aligned(4096)));
-struct e1000_rx_desc rxd_arr[E1000_RXDARR_LEN] __attribute__((aligned(4096)));
-packet_t txd_bufs[E1000_TXDARR_LEN] __attribute__((aligned(4096)));
-packet_t rxd_bufs[E1000_RXDARR_LEN] __attribute__((aligned(4096)));
+// Descriptor rings, allocated as physically contiguous blocks at attach.
+struct e1000_tx_desc *txd_arr;
+struct e1000_rx_desc *rxd_arr;
 uint8_t e1000_irq;
 
+// Protects the transmit and receive rings and their next indices.
+static struct spinlock e1000_lock = {
+	.name = "e1000_lock"
+};
+
 
 uint64_t macaddr = 0;
 
@@ -43,6 +48,22 @@ uint64_t E1000_get_macaddr()
 }
 
 
+/* Allocate a zeroed, physically contiguous block of at least
+ * size bytes for the card to reach by DMA.
+ */
+static void *_alloc_dma(size_t size)
+{
+    int order = 0;
+    struct PageInfo *pp;
+
+    while ((PGSIZE << order) < size)
+        order++;
+    if (!(pp = page_alloc_order(order, ALLOC_ZERO)))
+        return NULL;
+    pp->pp_ref++; // The card holds it for good.
+    return page2kva(pp);
+}
+
 /* Reset the TXD array entry corresponding to the given
  * index such that it may be resused for another packet.
  */
@@ -71,6 +92,11 @@ int E1000_attach(struct pci_func *pcif)
     e1000addr = mmio_map_region(pcif->reg_base[0], pcif->reg_size[0]);
 
     int i ;
+    txd_arr = _alloc_dma(sizeof(struct e1000_tx_desc) * E1000_TXDARR_LEN);
+    rxd_arr = _alloc_dma(sizeof(struct e1000_rx_desc) * E1000_RXDARR_LEN);
+    if (!txd_arr || !rxd_arr)
+        return -E_NO_MEM;
+
     // Initialize MMIO Region
     // Transmit initialization
     *(uint32_t *)(e1000addr+E1000_TDBAL) = (uint32_t)(PADDR(txd_arr)); // Indicates start of descriptor ring buffer
@@ -125,10 +151,13 @@ int E1000_attach(struct pci_func *pcif)
 int E1000_transmit(void * data_addr, uint16_t length)
 {
     static uint32_t nextindex = 0;
+    spin_lock(&e1000_lock);
     struct e1000_tx_desc *nextdesc = (&txd_arr[nextindex]);
 
-    if (!(nextdesc->status & E1000_TXD_STAT_DD))
+    if (!(nextdesc->status & E1000_TXD_STAT_DD)) {
+        spin_unlock(&e1000_lock);
         return -E_TXD_FULL; // no free descriptors, buffer is full
+    }
 
     if (length > E1000_ETH_PACKET_LEN)
         length = E1000_ETH_PACKET_LEN;
@@ -139,6 +168,7 @@ int E1000_transmit(void * data_addr, uint16_t length)
 
     nextindex = (nextindex+1)%E1000_TXDARR_LEN;
     *(uint32_t *)(e1000addr+E1000_TDT) = nextindex;
+    spin_unlock(&e1000_lock);
     return 0;
 }
 
@@ -146,22 +176,31 @@ int E1000_transmit(void * data_addr, uint16_t length)
 int E1000_receive(void * page_addr, uint16_t *len_store)
 {
     static uint32_t nextindex = 0;
-    struct e1000_rx_desc *nextdesc = (&rxd_arr[nextindex]);
+    int r = 0;
     if (!len_store) return -E_INVAL;
 
-    if (!(nextdesc->status & E1000_RXD_STAT_DD))
-        return -E_RXD_EMPTY; // Buffer is empty
+    spin_lock(&e1000_lock);
+    struct e1000_rx_desc *nextdesc = (&rxd_arr[nextindex]);
+    if (!(nextdesc->status & E1000_RXD_STAT_DD)) {
+        r = -E_RXD_EMPTY; // Buffer is empty
+        goto out;
+    }
 
 
     struct PageInfo *pp = pa2page(rxd_arr[nextindex].buffer_addr);
-    if (page_insert(curenv->env_pgdir, pp, page_addr ,PTE_W|PTE_U|PTE_P) < 0)
-        return -E_NO_MEM;
+    if (page_insert(curenv->env_pgdir, pp, page_addr ,PTE_W|PTE_U|PTE_P) < 0) {
+        r = -E_NO_MEM;
+        goto out;
+    }
     page_decref(pp);
     *len_store = rxd_arr[nextindex].length;
 
     //Allocating page for the NIC:
     pp = page_alloc(1);
-    if (!pp) return -E_NO_MEM;
+    if (!pp) {
+        r = -E_NO_MEM;
+        goto out;
+    }
 	   rxd_arr[nextindex].buffer_addr = page2pa(pp) + HEAD_SIZE;
 	   ++pp->pp_ref;
      *(uint32_t *)(e1000addr+E1000_RDT) = nextindex;
@@ -169,7 +208,9 @@ int E1000_receive(void * page_addr, uint16_t *len_store)
 	  nextindex = nextindex % E1000_RXDARR_LEN;
 
     // nextindex = (nextindex+1) % E1000_RXDARR_LEN;
-    return 0;
+out:
+    spin_unlock(&e1000_lock);
+    return r;
 }
 
 
@@ -199,7 +240,7 @@ e1000_trap_handler(void)
 	}
 
 	else {
-		waiting->env_status = ENV_RUNNABLE;
+		sched_enqueue(waiting);
 		waiting->e1000_waiting = false;
 		clear_e1000_interrupt();
     //sched_yield();
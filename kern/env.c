@@ -19,6 +19,17 @@ struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
+// Protects env_free_list.
+static struct spinlock env_table_lock = {
+	.name = "env_table_lock"
+};
+
+// Per-env locks, indexed like envs[].  An env's lock must be held
+// while changing its page tables and while it is being freed, so
+// that system calls running without the big kernel lock can safely
+// work on other envs' address spaces.
+static struct spinlock env_locks[NENV];
+
 #define ENVGENSHIFT	12		// >= LOGNENV
 
 // Global descriptor table.
@@ -108,6 +119,19 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+// Acquire and release env e's lock.
+void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[e - envs]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e - envs]);
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -132,6 +156,8 @@ env_init(void)
 			prev = &(envs[i]);
 
 		}
+	for (i = 0; i < NENV; i++)
+		__spin_initlock(&env_locks[i], "env_lock");
 	classifier_data_index = 0;
 	classifier_ready  =false;
 	// Per-CPU part of the initialization
@@ -222,12 +248,22 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_table_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_table_lock);
 		return -E_NO_FREE_ENV;
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_table_lock);
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_table_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_table_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -238,8 +274,14 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_priority = ENV_PRIO_NORMAL;
+	e->env_weight = ENV_WEIGHT_DEFAULT;
+	memset(e->env_umem_cache, 0, sizeof(e->env_umem_cache));
+	e->env_doorbell_waiting = 0;
+	e->env_doorbell = 0;
+	e->env_ipc_senders = NULL;
+	e->env_ipc_send_to = NULL;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -273,8 +315,8 @@ memset(e->env_upcalls, 0, sizeof(void *) * 16);
 	e->env_ipc_recving = 0;
 
 	// commit the allocation
-	env_free_list = e->env_link;
 	*newenv_store = e;
+	sched_enqueue(e);
 
 	e->e1000_waiting = false;
 	// Classifier Fields initialization:
@@ -323,6 +365,45 @@ region_alloc(struct Env *e, void *va, size_t len)
          }
 }
 
+//
+// Like region_alloc, but only reserve the pages (see page_reserve):
+// each gets allocated, zeroed, when the environment first touches it.
+// Panic if a page table can't be allocated.
+//
+void
+region_reserve(struct Env *e, void *va, size_t len)
+{
+	uintptr_t start = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	uintptr_t end = ROUNDUP((uintptr_t) va + len, PGSIZE);
+
+	for (; start < end; start += PGSIZE)
+		if (page_reserve(e->env_pgdir, (void *) start,
+				 PTE_W | PTE_U | PTE_P) < 0)
+			panic("region_reserve: out of free memory");
+}
+
+//
+// Load an ELF segment of 'memsz' bytes at 'va' in environment e, whose
+// page directory must be loaded, from the 'filesz' bytes at 'src'.
+// Only the pages holding file data are allocated now; the rest of the
+// segment (its bss, mostly) is reserved with region_reserve, so an
+// environment only uses memory for the bss it touches.
+//
+void
+region_load(struct Env *e, void *va, size_t memsz, const void *src, size_t filesz)
+{
+	uintptr_t end = (uintptr_t) va + memsz;
+	uintptr_t lazy = ROUNDUP((uintptr_t) va + filesz, PGSIZE);
+
+	if (lazy > end)
+		lazy = end;
+	// region_alloc's pages come zeroed.
+	region_alloc(e, va, lazy - (uintptr_t) va);
+	if (lazy < end)
+		region_reserve(e, (void *) lazy, end - lazy);
+	memcpy(va, src, filesz);
+}
+
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
@@ -389,9 +470,7 @@ load_icode(struct Env *e, uint8_t *binary)
 			void * va = (void *)ph->p_va;
 			size_t mem_sz = ph->p_memsz;
 			void* start = (binary + ph->p_offset);  //(void*)((uint32_t)
-			region_alloc(e,va,mem_sz);
-			memset(va,'\0',mem_sz);
-			memcpy(va,start,ph->p_filesz); /* TODO: maybe should chnage pgdir in cr3 */
+			region_load(e,va,mem_sz,start,ph->p_filesz);
 
 		}
 	}
@@ -431,21 +510,72 @@ env_create(uint8_t *binary, enum EnvType type)
 	if(type == ENV_TYPE_FS){
 		new_env->env_tf.tf_eflags |= FL_IOPL_MASK;
 	}
+	// Servers must answer requests promptly however many user
+	// envs are competing for the CPU.
+	if(type == ENV_TYPE_FS || type == ENV_TYPE_NS){
+		new_env->env_priority = ENV_PRIO_SERVER;
+	}
 
 	load_icode(new_env, binary);//until here goodman
 
 }
 
+//
+// Drop the pages held by e's blocked sys_ipc_sendv, if any.
+//
+void
+env_ipc_send_release(struct Env *e)
+{
+	while (e->env_ipc_send_npages > 0)
+		page_decref(e->env_ipc_send_pages[--e->env_ipc_send_npages]);
+}
+
+//
+// Take e off the queue of the env it is blocked sending to, if any,
+// and fail the sends blocked on e with -E_BAD_ENV.
+//
+static void
+env_ipc_cancel(struct Env *e)
+{
+	struct Env *dst, *prev, *s;
+
+	if ((dst = e->env_ipc_send_to)) {
+		prev = NULL;
+		for (s = dst->env_ipc_senders; s != e; s = s->env_ipc_send_link)
+			prev = s;
+		if (prev)
+			prev->env_ipc_send_link = e->env_ipc_send_link;
+		else
+			dst->env_ipc_senders = e->env_ipc_send_link;
+		if (dst->env_ipc_senders_tail == e)
+			dst->env_ipc_senders_tail = prev;
+		e->env_ipc_send_to = NULL;
+		env_ipc_send_release(e);
+	}
+
+	while ((s = e->env_ipc_senders)) {
+		e->env_ipc_senders = s->env_ipc_send_link;
+		s->env_ipc_send_to = NULL;
+		env_ipc_send_release(s);
+		s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		sched_enqueue(s);
+	}
+}
+
 //
 // Frees env e and all memory it uses.
 //
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
+	uint32_t pdeno;
 	physaddr_t pa;
 
+	// A sleeping env must not be woken after its slot is reused,
+	// nor an env blocked in IPC with it.
+	sched_sleep_cancel(e);
+	env_ipc_cancel(e);
+
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
@@ -454,28 +584,15 @@ env_free(struct Env *e)
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+	env_lock(e);
 
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
 
-		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
-			continue;
-
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
-
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-		}
-
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
+		// drop the page table, which unmaps its pages once no
+		// other env shares it (see pgdir_copy_cow), or the 4MB page
+		pde_remove(e->env_pgdir, PGADDR(pdeno, 0, 0));
 	}
 
 	// free the page directory
@@ -485,8 +602,11 @@ env_free(struct Env *e)
 
 	// return the environment to the free list
 	e->env_status = ENV_FREE;
+	env_unlock(e);
+	spin_lock(&env_table_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_table_lock);
 }
 
 //
@@ -526,6 +646,26 @@ env_pop_tf(struct Trapframe *tf)
 	// Record the CPU we are running on for user-space debugging
 	curenv->env_cpunum = cpunum();
 
+	// A system call made with sysenter returns with sysexit, which
+	// takes the user %eip in %edx and %esp in %ecx (the stub in
+	// lib/syscall.c expects both to be clobbered).  Restore eflags
+	// with IF still clear; the sti takes effect only after sysexit.
+	// TF is cleared too, or the popfl would single-step the kernel.
+	if (tf->tf_trapno == T_SYSENTER)
+		__asm __volatile("movl %0,%%esp\n"
+			"\tpopal\n"
+			"\tpopl %%es\n"
+			"\tpopl %%ds\n"
+			"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
+			"\tmovl 0x0(%%esp),%%edx\n" /* tf_eip */
+			"\tmovl 0xc(%%esp),%%ecx\n" /* tf_esp */
+			"\taddl $0x8,%%esp\n" /* skip tf_eip and tf_cs */
+			"\tandl %1,(%%esp)\n"
+			"\tpopfl\n"
+			"\tsti\n"
+			"\tsysexit"
+			: : "g" (tf), "i" (~(FL_IF | FL_TF)) : "memory");
+
 	__asm __volatile("movl %0,%%esp\n"
 		"\tpopal\n"
 		"\tpopl %%es\n"
@@ -564,11 +704,20 @@ env_run(struct Env *e)
 
 	// LAB 3: Your code here.
 	if(curenv && curenv != e && curenv->env_status == ENV_RUNNING) {
-				curenv->env_status = ENV_RUNNABLE;
+				sched_enqueue(curenv);
 	}
+	bool switching = (curenv != e);
 	curenv = e;
+	// Wait out any system call on another CPU that is changing e's
+	// page tables; it only does so while e is not ENV_RUNNING.
+	env_lock(e);
 	curenv->env_status = ENV_RUNNING;
+	env_unlock(e);
 	curenv->env_runs++;
+	// A newly switched-to env gets a full tick before the timer
+	// preempts it, whether or not the scheduler picked it.
+	if(switching)
+		sched_start_tick();
 	lcr3(PADDR(curenv->env_pgdir));
 	unlock_kernel();
 	env_pop_tf(&curenv->env_tf);
@@ -18,7 +18,12 @@ void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+void	env_lock(struct Env *e);
+void	env_unlock(struct Env *e);
+void	env_ipc_send_release(struct Env *e);
 void region_alloc(struct Env *e, void *va, size_t len);
+void region_reserve(struct Env *e, void *va, size_t len);
+void region_load(struct Env *e, void *va, size_t memsz, const void *src, size_t filesz);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
@@ -45,6 +45,10 @@ i386_init(void)
 	env_init();
 	trap_init();
 
+	// Calibrate the TSC before lapic_init calibrates its timer
+	// against it.
+	time_init();
+
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
 	lapic_init();
@@ -53,7 +57,6 @@ i386_init(void)
 	pic_init();
 
 	// Lab 6 hardware initialization functions
-	time_init();
 	pci_init();
 
 	// Acquire the big kernel lock before waking up APs
@@ -125,6 +128,7 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir
+	lcr4(rcr4() | CR4_PSE | CR4_PGE);
 	lcr3(PADDR(kern_pgdir));
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
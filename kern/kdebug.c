@@ -143,7 +143,7 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 		// Return -1 if it is not.  Hint: Call user_mem_check.
 		// LAB 3: Your code here.
 		int32_t res;
-		res = user_mem_check(curenv,usd, sizeof(struct UserStabData ),PTE_U|PTE_W);
+		res = user_mem_check(curenv,usd, sizeof(struct UserStabData ),PTE_U);
 		if(res) return -1;
 		stabs = usd->stabs;
 		stab_end = usd->stab_end;
@@ -152,9 +152,9 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 
 		// Make sure the STABS and string table memory is valid.
 		// LAB 3: Your code here.
-		res = user_mem_check(curenv,stabs,stab_end-stabs,PTE_U|PTE_W);
+		res = user_mem_check(curenv,stabs,stab_end-stabs,PTE_U);
 		if(res) return -1;
-		res = user_mem_check(curenv,stabstr,stabstr_end-stabstr,PTE_U|PTE_W);
+		res = user_mem_check(curenv,stabstr,stabstr_end-stabstr,PTE_U);
 		if(res) return -1;
 	}
 
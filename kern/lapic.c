@@ -9,6 +9,7 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/time.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -45,6 +46,10 @@
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+// Timer counts per millisecond, measured on the boot CPU.  All CPUs
+// share one bus clock, so the APs reuse it.
+static uint32_t lapic_timer_per_ms;
+
 static void
 lapicw(int index, int value)
 {
@@ -52,6 +57,21 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+// Measure how fast the timer counts down, using the TSC as reference.
+static void
+lapic_calibrate(void)
+{
+	uint64_t start;
+
+	lapicw(TIMER, MASKED);
+	lapicw(TICR, 0xFFFFFFFF);
+	start = read_tsc();
+	while (read_tsc() - start < (uint64_t) tsc_per_ms * 10)
+		/* spin */;
+	lapic_timer_per_ms = (0xFFFFFFFF - lapic[TCCR]) / 10;
+	lapicw(TICR, 0);
+}
+
 void
 lapic_init(void)
 {
@@ -65,13 +85,13 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down once at bus frequency from lapic[TICR]
+	// and then issues an interrupt.  It stays idle until the
+	// scheduler arms it with lapic_timer_oneshot.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	if (!lapic_timer_per_ms)
+		lapic_calibrate();
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -173,6 +193,33 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	}
 }
 
+// Arm this CPU's timer to interrupt once, 'us' microseconds from now.
+// 0 disarms it.
+void
+lapic_timer_oneshot(uint32_t us)
+{
+	uint64_t count;
+
+	if (!lapic)
+		return;
+	count = (uint64_t) us * lapic_timer_per_ms / 1000;
+	if (us && count == 0)
+		count = 1;
+	if (count > 0xFFFFFFFF)
+		count = 0xFFFFFFFF;
+	lapicw(TICR, count);
+}
+
+// Send interrupt 'vector' to the CPU with local APIC ID 'apicid'.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
 void
 lapic_ipi(int vector)
 {
@@ -12,6 +12,7 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/pmap.h>
+#include <kern/spinlock.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -31,6 +32,8 @@ static struct Command commands[] = {
 	{ "setprems", "Set premissions of given mapping. [11 -> UW, 10 -> U, 01 -> W, 00 -> N/A] ", mon_setprems },
 	{ "padump", "Dump memory content from given *PHYSICAL* address", mon_padump },
 	{ "vadump", "Dump memory content from given *VIRTUAL* address", mon_vadump },
+	{ "lockstat", "Display spinlock contention statistics [reset]", mon_lockstat },
+	{ "ptstat", "Display page table sharing statistics [reset]", mon_ptstat },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -121,6 +124,7 @@ mon_showmaps(int argc, char **argv, struct Trapframe *tf)
 					continue;
 		}
 		addr = PGNUM(*cuu_page) << PTXSHIFT;
+		if(*cuu_page & PTE_PS) addr += PTX(i) << PTXSHIFT; //4MB page
 		prem = PGOFF(*cuu_page);
 		if (prem & PTE_P) prem_str[0] = 'P';
 		if (prem & PTE_W) prem_str[1] = 'W';
@@ -196,6 +200,7 @@ mon_vadump(int argc, char **argv, struct Trapframe *tf)
 					continue;
 		}
 		addr = PGNUM(*cuu_page) << PTXSHIFT;
+		if(*cuu_page & PTE_PS) addr += PTX(i) << PTXSHIFT; //4MB page
 		addr += PGOFF(i);
 		if (i + (PGSIZE-PGOFF(i)) >= high_vaddr){
 			size = high_vaddr - i;
@@ -260,6 +265,72 @@ mon_padump(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+// Locks sharing a name (e.g. the per-env locks) are added up into one line.
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	struct spinlock *lk, *other;
+	uint64_t acq, cont, cycles;
+	int nlocks;
+
+	if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+		for (lk = spinlock_list; lk; lk = lk->stat_link) {
+			lk->acquisitions = 0;
+			lk->contended = 0;
+			lk->spin_cycles = 0;
+		}
+		return 0;
+	}
+
+	cprintf("%-16s %5s %12s %12s %12s\n", "lock", "count",
+		"acquired", "contended", "avg spin");
+	for (lk = spinlock_list; lk; lk = lk->stat_link) {
+		// Print each name once, at its first lock on the list.
+		for (other = spinlock_list; other != lk; other = other->stat_link)
+			if (strcmp(other->name, lk->name) == 0)
+				break;
+		if (other != lk)
+			continue;
+
+		acq = cont = cycles = 0;
+		nlocks = 0;
+		for (other = lk; other; other = other->stat_link) {
+			if (strcmp(other->name, lk->name) != 0)
+				continue;
+			acq += other->acquisitions;
+			cont += other->contended;
+			cycles += other->spin_cycles;
+			nlocks++;
+		}
+		cprintf("%-16s %5d %12llu %12llu %12llu\n", lk->name, nlocks,
+			acq, cont, cont ? cycles / cont : 0);
+	}
+	return 0;
+}
+
+// Each shared page table is a page fork did not have to allocate or fill
+// in, unless it was later copied.
+int
+mon_ptstat(int argc, char **argv, struct Trapframe *tf)
+{
+	struct PgtableStats *st = &pgtable_stats;
+
+	if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+		st->shared = st->copied = st->forks = 0;
+		st->fork_cycles = st->copy_cycles = 0;
+		return 0;
+	}
+
+	cprintf("page tables in use:   %u (%uKB)\n", st->pages, st->pages * 4);
+	cprintf("shared by fork:       %u, %u later copied, %u pages saved\n",
+		st->shared, st->copied, st->shared - st->copied);
+	cprintf("avg fork copy:        %llu cycles over %u forks\n",
+		st->forks ? st->fork_cycles / st->forks : 0, st->forks);
+	cprintf("avg page table copy:  %llu cycles\n",
+		st->copied ? st->copy_cycles / st->copied : 0);
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -20,4 +20,6 @@ int mon_showmaps(int argc, char **argv, struct Trapframe *tf);
 int mon_setprems(int argc, char **argv, struct Trapframe *tf);
 int mon_vadump(int argc, char **argv, struct Trapframe *tf);
 int mon_padump(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
+int mon_ptstat(int argc, char **argv, struct Trapframe *tf);
 #endif	// !JOS_KERN_MONITOR_H
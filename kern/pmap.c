@@ -10,6 +10,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -20,6 +21,40 @@ pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
 static struct PageInfo *page_free_list;	// Free list of physical pages
 
+// Protects page_free_list and the buddy free lists.  Reference counts
+// are updated atomically instead, so mapping a page does not need to
+// take this lock.
+static struct spinlock page_lock = {
+	.name = "page_lock"
+};
+
+// Buddy allocator.  Once mem_init's checks, which look at page_free_list
+// directly, are done, every free page moves into buddy_free_list:
+// buddy_free_list[k] links (through pp_link and pp_prev) the free blocks
+// of 2^k pages, each aligned to its size.  Freeing a block merges it with
+// its buddy, the other half of the block twice its size, whenever that
+// is free too.
+#define BUDDY_ORDERS		(MAX_PAGE_ORDER + 1)
+static struct PageInfo *buddy_free_list[BUDDY_ORDERS];
+
+// Page table usage, for the monitor's "ptstat" command.
+struct PgtableStats pgtable_stats;
+
+// Each CPU keeps up to PAGE_CACHE_MAX free pages of its own, so that
+// most allocations and frees don't touch page_lock.  The cache refills
+// from the buddy allocator a PAGE_CACHE_ORDER block at a time, and
+// drains back to it PAGE_CACHE_BATCH pages at a time.  Like the buddy
+// allocator, it is only used once page_cache_ready is set.
+#define PAGE_CACHE_ORDER	4
+#define PAGE_CACHE_BATCH	(1 << PAGE_CACHE_ORDER)
+#define PAGE_CACHE_MAX		(2 * PAGE_CACHE_BATCH)
+static bool page_cache_ready;
+
+// Free pages that idle CPUs have already zeroed, for ALLOC_ZERO
+// allocations (see page_zero_idle).  Also protected by page_lock.
+#define PAGE_ZERO_MAX		256
+static struct PageInfo *page_zero_list;
+static uint32_t page_zero_count;
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -60,7 +95,11 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static struct PageInfo *buddy_alloc(int order);
+static void buddy_free(struct PageInfo *pp, int order);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void umem_invalidate(pde_t *pgdir);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
@@ -124,6 +163,7 @@ mem_init(void)
 {
 	uint32_t cr0;
 	size_t n;
+	struct PageInfo *pp;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
@@ -189,7 +229,7 @@ mem_init(void)
 	// Your code goes here:
 
 	uint32_t pg_size = npages * sizeof(struct PageInfo);
-  boot_map_region(kern_pgdir, UPAGES, pg_size, PADDR(pages), PTE_U | PTE_P);
+  boot_map_region(kern_pgdir, UPAGES, pg_size, PADDR(pages), PTE_U | PTE_P | PTE_G);
 	boot_map_region(kern_pgdir,(uintptr_t) pages, pg_size,PADDR(pages),PTE_W | PTE_P);
 
 	//////////////////////////////////////////////////////////////////////
@@ -200,7 +240,7 @@ mem_init(void)
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
 	// uint32_t env_size = NENV * sizeof(struct Env);
-	boot_map_region(kern_pgdir,  UENVS, envs_bytes, PADDR(envs), PTE_U | PTE_P);
+	boot_map_region(kern_pgdir,  UENVS, envs_bytes, PADDR(envs), PTE_U | PTE_P | PTE_G);
 	boot_map_region(kern_pgdir, (uintptr_t) envs, envs_bytes, PADDR(envs), PTE_W | PTE_P);
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -213,7 +253,7 @@ mem_init(void)
 	//       overwrite memory.  Known as a "guard page".
 	//     Permissions: kernel RW, user NONE
 	// Your code goes here:
-	boot_map_region(kern_pgdir,KSTACKTOP-KSTKSIZE,KSTKSIZE,PADDR(bootstack),PTE_W | PTE_P);
+	boot_map_region(kern_pgdir,KSTACKTOP-KSTKSIZE,KSTKSIZE,PADDR(bootstack),PTE_W | PTE_P | PTE_G);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
@@ -223,7 +263,8 @@ mem_init(void)
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
-	boot_map_region(kern_pgdir,KERNBASE,0xffffffff-KERNBASE+1,0x0,PTE_W | PTE_P);
+	// Use 4MB pages: no page tables, and far fewer TLB entries.
+	boot_map_region_large(kern_pgdir,KERNBASE,0xffffffff-KERNBASE+1,0x0,PTE_W | PTE_G);
 
 	// Initialize the SMP-related parts of the memory map
 	mem_init_mp();
@@ -239,6 +280,13 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
+	//
+	// The kernel's mappings above UTOP are the same in every env_pgdir
+	// and are marked PTE_G, so with CR4_PGE set they stay in the TLB
+	// across the cr3 loads in env_run.  The catch is that changing one
+	// takes an invlpg (tlb_invalidate); reloading cr3 won't flush it.
+	// UVPT differs between envs, so it is not marked.
+	lcr4(rcr4() | CR4_PSE | CR4_PGE);
 	lcr3(PADDR(kern_pgdir));
 
 	check_page_free_list(0);
@@ -252,6 +300,14 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	// Hand the free pages over to the buddy allocator.
+	while ((pp = page_free_list)) {
+		page_free_list = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	page_cache_ready = true;
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -290,7 +346,7 @@ mem_init_mp(void)
 	for(i=0; i < NCPU; i++){
 		uintptr_t va_add = (uintptr_t)(KSTACKTOP-(KSTKSIZE+KSTKGAP)*(i));
 		va_add = va_add - KSTKSIZE;
-		boot_map_region(kern_pgdir,va_add,KSTKSIZE,PADDR(percpu_kstacks[i]),PTE_W);
+		boot_map_region(kern_pgdir,va_add,KSTKSIZE,PADDR(percpu_kstacks[i]),PTE_W | PTE_G);
 	}
 }
 
@@ -371,17 +427,70 @@ page_init(void)
 // Be sure to set the pp_link field of the allocated page to NULL so
 // page_free can check for double-free bugs.
 //
-// Returns NULL if out of free memory.
+// Returns NULL if out of free memory.  (Pages cached by other CPUs are
+// not counted; see PAGE_CACHE_MAX.)
 //
 // Hint: use page2kva and memset
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-	struct PageInfo* result = page_free_list;
-	if(!result) return NULL;
+	struct CpuInfo *c = thiscpu;
+	struct PageInfo *result;
+	int i;
+
+	// A page zeroed while some CPU was idle saves the memset.
+	if ((alloc_flags & ALLOC_ZERO) && page_zero_list) {
+		spin_lock(&page_lock);
+		if ((result = page_zero_list)) {
+			page_zero_list = result->pp_link;
+			page_zero_count--;
+		}
+		spin_unlock(&page_lock);
+		if (result) {
+			result->pp_link = NULL;
+			return result;
+		}
+	}
+
+	if (!page_cache_ready) {
+		spin_lock(&page_lock);
+		if ((result = page_free_list))
+			page_free_list = result->pp_link;
+		spin_unlock(&page_lock);
+		goto got;
+	}
+
+	if (!c->cpu_free_pages) {
+		spin_lock(&page_lock);
+		if ((result = buddy_alloc(PAGE_CACHE_ORDER))) {
+			for (i = 0; i < PAGE_CACHE_BATCH; i++) {
+				result[i].pp_link = c->cpu_free_pages;
+				c->cpu_free_pages = &result[i];
+			}
+			c->cpu_nfree_pages += PAGE_CACHE_BATCH;
+		} else if ((result = buddy_alloc(0)) ||
+			   (result = page_zero_list)) {
+			// Memory is short or fragmented; zeroed pages are
+			// free pages too.
+			if (result == page_zero_list) {
+				page_zero_list = result->pp_link;
+				page_zero_count--;
+			}
+			result->pp_link = NULL;
+			c->cpu_free_pages = result;
+			c->cpu_nfree_pages++;
+		}
+		spin_unlock(&page_lock);
+	}
+	if ((result = c->cpu_free_pages)) {
+		c->cpu_free_pages = result->pp_link;
+		c->cpu_nfree_pages--;
+	}
 
-	page_free_list = page_free_list->pp_link;
+got:
+	if(!result)
+		return NULL;
 	result->pp_link = NULL;
 	result->pp_ref = 0;
 	if (alloc_flags & ALLOC_ZERO){
@@ -400,20 +509,191 @@ page_free(struct PageInfo *pp)
 	// Fill this function in
 	// Hint: You may want to panic if pp->pp_ref is nonzero or
 	// pp->pp_link is not NULL.
+	struct CpuInfo *c = thiscpu;
+	int i;
+
 	if(pp->pp_ref != 0) panic("Error in page_free: pp_ref is not 0!");
 	if(pp->pp_link != NULL) panic("Error in page_free: pp_link is not null!");
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	if (!page_cache_ready) {
+		spin_lock(&page_lock);
+		pp->pp_link = page_free_list;
+		page_free_list = pp;
+		spin_unlock(&page_lock);
+		return;
+	}
+
+	pp->pp_link = c->cpu_free_pages;
+	c->cpu_free_pages = pp;
+	if (++c->cpu_nfree_pages <= PAGE_CACHE_MAX)
+		return;
+	spin_lock(&page_lock);
+	for (i = 0; i < PAGE_CACHE_BATCH; i++) {
+		pp = c->cpu_free_pages;
+		c->cpu_free_pages = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	c->cpu_nfree_pages -= PAGE_CACHE_BATCH;
+	spin_unlock(&page_lock);
+}
+
+//
+// Allocates 2^order physically contiguous pages, aligned to their size,
+// for memory that devices reach by physical address (DMA rings and
+// buffers) or that is mapped as one large page.  Returns the first
+// page; the rest follow it in pages[].  If (alloc_flags & ALLOC_ZERO),
+// the whole range is zeroed.  No reference counts are incremented.
+//
+// Returns NULL if order is out of range, or there is no free block that
+// large.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+	int i;
+
+	if (order < 0 || order > MAX_PAGE_ORDER || !page_cache_ready)
+		return NULL;
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	if (!pp)
+		return NULL;
+	for (i = 0; i < (1 << order); i++) {
+		pp[i].pp_link = NULL;
+		pp[i].pp_ref = 0;
+	}
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Return a block from page_alloc_order to the buddy allocator.
+// Every page in it must have a zero reference count.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	int i;
+
+	for (i = 0; i < (1 << order); i++)
+		if (pp[i].pp_ref != 0 || pp[i].pp_link != NULL)
+			panic("page_free_order: page %d of the block is in use", i);
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
+// Put the free block of 2^order pages at pp on its free list.
+static void
+buddy_link(struct PageInfo *pp, int order)
+{
+	pp->pp_buddy = order + 1;
+	pp->pp_prev = NULL;
+	pp->pp_link = buddy_free_list[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	buddy_free_list[order] = pp;
+}
+
+// Take the free block of 2^order pages at pp off its free list.
+static void
+buddy_unlink(struct PageInfo *pp, int order)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		buddy_free_list[order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_buddy = 0;
+	pp->pp_link = pp->pp_prev = NULL;
+}
+
+// Take a block of 2^order pages, splitting a larger one if need be.
+// page_lock must be held.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int k;
+
+	for (k = order; k < BUDDY_ORDERS && !buddy_free_list[k]; k++)
+		/* do nothing */;
+	if (k == BUDDY_ORDERS)
+		return NULL;
+	pp = buddy_free_list[k];
+	buddy_unlink(pp, k);
+	// Give back the upper halves we don't need.
+	while (k > order) {
+		k--;
+		buddy_link(pp + (1 << k), k);
+	}
+	return pp;
+}
+
+// Free the block of 2^order pages at pp, merging it with its buddies.
+// page_lock must be held.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t i = pp - pages, buddy;
+
+	for (; order < MAX_PAGE_ORDER; order++) {
+		buddy = i ^ (1 << order);
+		if (buddy + (1 << order) > npages ||
+		    pages[buddy].pp_buddy != order + 1)
+			break;
+		buddy_unlink(&pages[buddy], order);
+		i &= ~(1 << order);
+	}
+	buddy_link(&pages[i], order);
+}
+
+//
+// Zero up to PAGE_CACHE_BATCH free pages for later ALLOC_ZERO
+// allocations, so that they don't pay for the memset.
+// Called by CPUs about to halt, without the big kernel lock.
+//
+void
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+	int i;
+
+	if (!page_cache_ready)
+		return;
+	for (i = 0; i < PAGE_CACHE_BATCH; i++) {
+		spin_lock(&page_lock);
+		if (page_zero_count >= PAGE_ZERO_MAX || !(pp = buddy_alloc(0))) {
+			spin_unlock(&page_lock);
+			return;
+		}
+		// Count it now, so other idle CPUs don't overfill the pool.
+		page_zero_count++;
+		spin_unlock(&page_lock);
+
+		memset(page2kva(pp), 0, PGSIZE);
+
+		spin_lock(&page_lock);
+		pp->pp_link = page_zero_list;
+		page_zero_list = pp;
+		spin_unlock(&page_lock);
+	}
 }
 
 //
 // Decrement the reference count on a page,
 // freeing it if there are no more refs.
+// The decrement is atomic, since the page may be mapped by envs that
+// are being changed on other CPUs at the same time.
 //
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	if (__sync_sub_and_fetch(&pp->pp_ref, 1) == 0)
 		page_free(pp);
 }
 
@@ -429,6 +709,14 @@ page_decref(struct PageInfo* pp)
 //	the page is cleared,
 //	and pgdir_walk returns a pointer into the new page table page.
 //
+// If the page table is shared copy-on-write with other page directories
+// (see pgdir_copy_cow) and create is true, pgdir first gets its own copy
+// of it, since the caller may be about to change the entry.
+//
+// If va lies in a 4MB page (PTE_PS), there is no page table: pgdir_walk
+// returns a pointer to the page directory entry if create is false, and
+// otherwise first splits the 4MB page into 4KB ones.
+//
 // Hint 1: you can turn a Page * into the physical address of the
 // page it refers to with page2pa() from kern/pmap.h.
 //
@@ -446,6 +734,10 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	pde_t pdx = PDX(va); //index in directory
 	pte_t ptx = PTX(va); //index in table
 	pte_t offst = PGOFF(va); //offest of the va
+	if((pgdir[pdx] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+		if(!create) return &pgdir[pdx];
+		if(pgdir_split_large(pgdir, va) < 0) return NULL;
+	}
 	pte_t pde = pgdir[pdx] ;
 	// Check if pt exists:
 	if(!(PGOFF(pde) & PTE_P)){
@@ -454,6 +746,9 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 		if(!pg) return NULL;
 		pg->pp_ref++;
 		pgdir[pdx] = page2pa(pg) | PTE_U | PTE_W | PTE_P;
+		__sync_add_and_fetch(&pgtable_stats.pages, 1);
+	} else if(create && pgdir_unshare(pgdir, va) < 0) {
+		return NULL;
 	}
 
 	pte_t* pt = KADDR(PTE_ADDR(pgdir[pdx]));
@@ -487,6 +782,96 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 	}
 }
 
+//
+// Like boot_map_region, but map with 4MB pages (PTE_PS), one page
+// directory entry each, rather than a page table's worth of 4KB ones.
+// Size is a multiple of PTSIZE, and va and pa are both PTSIZE-aligned.
+// CR4_PSE must be set before pgdir is loaded.
+//
+static void
+boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
+{
+	size_t i;
+
+	for (i = 0; i < size; i += PTSIZE)
+		pgdir[PDX(va + i)] = (pa + i) | perm | PTE_P | PTE_PS;
+}
+
+//
+// Map the 2^MAX_PAGE_ORDER contiguous pages starting at 'pp' (see
+// page_alloc_order) at the PTSIZE-aligned 'va' as one 4MB page, with
+// permissions 'perm|PTE_P|PTE_PS'.  Whatever pgdir mapped in
+// [va, va+PTSIZE) before is removed first.  Each of the pages gains a
+// reference, so that parts of the 4MB page can later be remapped or
+// unmapped 4KB at a time (see pgdir_split_large).
+//
+void
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	int i;
+
+	for (i = 0; i < NPTENTRIES; i++)
+		__sync_add_and_fetch(&pp[i].pp_ref, 1);
+	pde_remove(pgdir, va);
+	pgdir[PDX(va)] = page2pa(pp) | perm | PTE_P | PTE_PS;
+	if (!curenv || curenv->env_pgdir == pgdir)
+		tlbflush();
+}
+
+//
+// Remove whatever 'pgdir' maps in the 4MB region containing 'va', whether
+// a 4MB page or a page table, dropping its page references.  The TLB is
+// not flushed.
+//
+void
+pde_remove(pde_t *pgdir, void *va)
+{
+	pde_t pde = pgdir[PDX(va)];
+	struct PageInfo *pp;
+	int i;
+
+	if (!(pde & PTE_P))
+		return;
+	pgdir[PDX(va)] = 0;
+	umem_invalidate(pgdir);
+	pp = pa2page(PTE_ADDR(pde));
+	if (pde & PTE_PS) {
+		for (i = 0; i < NPTENTRIES; i++)
+			page_decref(&pp[i]);
+	} else
+		pgtable_decref(pp);
+}
+
+//
+// Replace the 4MB page mapping 'va' in 'pgdir' with a page table that
+// maps the same memory 4KB at a time, with the same permissions.
+// The pages already hold a reference each, so no counts change.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if the page table couldn't be allocated
+//
+int
+pgdir_split_large(pde_t *pgdir, const void *va)
+{
+	pde_t pde = pgdir[PDX(va)];
+	struct PageInfo *pt;
+	pte_t *ptes;
+	int i;
+
+	if (!(pt = page_alloc(0)))
+		return -E_NO_MEM;
+	ptes = page2kva(pt);
+	for (i = 0; i < NPTENTRIES; i++)
+		ptes[i] = (PTE_ADDR(pde) + (i << PTXSHIFT)) | (pde & PTE_SYSCALL);
+	pt->pp_ref = 1;
+	pgdir[PDX(va)] = page2pa(pt) | PTE_U | PTE_W | PTE_P;
+	__sync_add_and_fetch(&pgtable_stats.pages, 1);
+	if (!curenv || curenv->env_pgdir == pgdir)
+		tlbflush();
+	return 0;
+}
+
 //
 // Map the physical page 'pp' at virtual address 'va'.
 // The permissions (the low 12 bits) of the page table entry
@@ -517,6 +902,7 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
 	// Fill this function in
 	pte_t* curr_pte = pgdir_walk(pgdir,va,1);
+	bool remap = false;
 	if(!curr_pte) return -E_NO_MEM;
 
 	if((PGOFF(*curr_pte) & PTE_P) && (PTE_ADDR(*curr_pte) != page2pa(pp)) ){
@@ -524,10 +910,19 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	}
 
 	if(PTE_ADDR(*curr_pte) != page2pa(pp))
-		pp->pp_ref++;
+		__sync_add_and_fetch(&pp->pp_ref, 1);
+	else if(*curr_pte & PTE_P)
+		remap = true;
 
 
 	*curr_pte = page2pa(pp) | perm | PTE_P;
+	// Re-inserting the same page may narrow its permissions or clear
+	// PTE_A/PTE_D, and the TLB may still hold the old entry.  Flush it
+	// here: a system call can return without reloading cr3.
+	if (remap) {
+		umem_invalidate(pgdir);	// perm may be narrower
+		tlb_invalidate(pgdir, va);
+	}
 
 	return 0;
 }
@@ -551,6 +946,8 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 	if(!pte) return NULL;
 	if(!(*pte & PTE_P)) return NULL;
 	struct PageInfo* pg = pa2page(PTE_ADDR(*pte));
+	// Within a 4MB page, find the 4KB page at va.
+	if(pgdir[PDX(va)] & PTE_PS) pg += PTX(va);
 	if(pte_store != 0){
 		*pte_store = pte;
 	}
@@ -578,10 +975,26 @@ page_remove(pde_t *pgdir, void *va)
 	// Fill this function in
 	pte_t *pte_store;
 	struct PageInfo* the_pg = page_lookup(pgdir,va,&pte_store);
-	if(!the_pg) return;
-	page_decref(the_pg);
+	if(!the_pg) {
+		// Drop a reservation made by page_reserve.
+		if((pte_store = pgdir_walk(pgdir, va, 0))
+		   && (*pte_store & (PTE_P | PTE_LAZY)) == PTE_LAZY
+		   && (pte_store = pgdir_walk(pgdir, va, 1))) {
+			*pte_store = 0;
+			umem_invalidate(pgdir);
+		}
+		return;
+	}
+	// Other page directories sharing the page table keep the page, and
+	// the rest of a 4MB page stays mapped.  Without memory for the new
+	// page table this needs, the mapping stays.
+	if(!(pte_store = pgdir_walk(pgdir, va, 1))) return;
+	// Clear the mapping before dropping the reference, so the page
+	// is never reachable through pgdir once another CPU can reuse it.
 	*pte_store = 0;
 	tlb_invalidate(pgdir,va);
+	umem_invalidate(pgdir);
+	page_decref(the_pg);
 
 }
 
@@ -597,6 +1010,253 @@ tlb_invalidate(pde_t *pgdir, void *va)
 		invlpg(va);
 }
 
+//
+// Share the user page tables in [0, end) of 'srcpgdir' with 'dstpgdir',
+// for a copy-on-write fork.  Each page table wholly below end is shared
+// read-only (its PDEs lose PTE_W and gain PTE_COW) until either side
+// changes it, when pgdir_unshare gives that side a copy.  This costs one
+// step per page table rather than one per page.  The entries of a page
+// table that end splits are copied, with writable pages becoming
+// read-only PTE_COW pages in both page directories.  No page is copied.
+// The caller must flush srcpgdir's TLB entries afterwards.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated
+//
+int
+pgdir_copy_cow(pde_t *dstpgdir, pde_t *srcpgdir, uintptr_t end)
+{
+	uint64_t start = read_tsc();
+	uintptr_t va;
+	pte_t *src, *dst;
+	int i, lazy, r = 0;
+
+	for (va = 0; va < end; va += PTSIZE) {
+		if (!(srcpgdir[PDX(va)] & PTE_P))
+			continue;
+
+		// A shared 4MB page is shared whole; any other one is split
+		// so that its 4KB pages can be copied one at a time.
+		if ((srcpgdir[PDX(va)] & (PTE_PS | PTE_SHARE)) == (PTE_PS | PTE_SHARE)
+		    && va + PTSIZE <= end) {
+			dstpgdir[PDX(va)] = srcpgdir[PDX(va)] & ~(PTE_A | PTE_D);
+			for (i = 0; i < NPTENTRIES; i++)
+				__sync_add_and_fetch(&pa2page(PTE_ADDR(srcpgdir[PDX(va)]))[i].pp_ref, 1);
+			continue;
+		}
+		if ((srcpgdir[PDX(va)] & PTE_PS)
+		    && (r = pgdir_split_large(srcpgdir, (void *) va)) < 0)
+			break;
+
+		if (va + PTSIZE <= end) {
+			srcpgdir[PDX(va)] = (srcpgdir[PDX(va)] & ~PTE_W) | PTE_COW;
+			dstpgdir[PDX(va)] = srcpgdir[PDX(va)];
+			__sync_add_and_fetch(&pa2page(PTE_ADDR(srcpgdir[PDX(va)]))->pp_ref, 1);
+			__sync_add_and_fetch(&pgtable_stats.shared, 1);
+			continue;
+		}
+
+		if ((r = pgdir_unshare(srcpgdir, (void *) va)) < 0)
+			break;
+		for (; va < end; va += PGSIZE) {
+			src = pgdir_walk(srcpgdir, (void *) va, 0);
+			lazy = (*src & (PTE_P | PTE_LAZY)) == PTE_LAZY;
+			if (!lazy && (*src & (PTE_P | PTE_U)) != (PTE_P | PTE_U))
+				continue;
+			if (!(dst = pgdir_walk(dstpgdir, (void *) va, 1))) {
+				r = -E_NO_MEM;
+				break;
+			}
+			if (lazy) {
+				*dst = *src;
+				continue;
+			}
+			if (!(*src & PTE_SHARE) && (*src & (PTE_W | PTE_COW)))
+				*src = (*src & ~PTE_W) | PTE_COW;
+			*dst = *src & ~(PTE_A | PTE_D);
+			__sync_add_and_fetch(&pa2page(PTE_ADDR(*src))->pp_ref, 1);
+		}
+	}
+
+	pgtable_stats.forks++;
+	pgtable_stats.fork_cycles += read_tsc() - start;
+	return r;
+}
+
+//
+// Give 'pgdir' its own copy of the page table covering 'va', if it
+// shares that page table copy-on-write with other page directories.
+// The copy's writable pages become copy-on-write for every sharer.
+//
+// RETURNS:
+//   0 on success, including when the page table isn't shared
+//   -E_NO_MEM, if there's no memory for the copy
+//
+int
+pgdir_unshare(pde_t *pgdir, const void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct PageInfo *old, *np;
+	pte_t *opt, *npt;
+	uint64_t start;
+	int i;
+
+	if ((*pde & (PTE_P | PTE_COW)) != (PTE_P | PTE_COW))
+		return 0;
+
+	// A page table only we hold can't gain another sharer behind our
+	// back, since sharing it takes forking us.
+	old = pa2page(PTE_ADDR(*pde));
+	if (old->pp_ref == 1) {
+		*pde = (*pde & ~PTE_COW) | PTE_W;
+	} else {
+		start = read_tsc();
+		if (!(np = page_alloc(0)))
+			return -E_NO_MEM;
+		opt = page2kva(old);
+		npt = page2kva(np);
+		for (i = 0; i < NPTENTRIES; i++) {
+			if ((opt[i] & (PTE_P | PTE_W)) == (PTE_P | PTE_W) &&
+			    !(opt[i] & PTE_SHARE))
+				opt[i] = (opt[i] & ~PTE_W) | PTE_COW;
+			npt[i] = opt[i];
+			if (npt[i] & PTE_P)
+				__sync_add_and_fetch(&pa2page(PTE_ADDR(npt[i]))->pp_ref, 1);
+		}
+		np->pp_ref = 1;
+		*pde = page2pa(np) | PTE_U | PTE_W | PTE_P;
+		pgtable_decref(old);
+
+		__sync_add_and_fetch(&pgtable_stats.pages, 1);
+		__sync_add_and_fetch(&pgtable_stats.copied, 1);
+		pgtable_stats.copy_cycles += read_tsc() - start;
+	}
+
+	if (!curenv || curenv->env_pgdir == pgdir)
+		tlbflush();
+	return 0;
+}
+
+//
+// Drop a reference to the page table page 'pp'.  Once no page directory
+// holds it, drop its references to the pages it maps and free it.
+//
+void
+pgtable_decref(struct PageInfo *pp)
+{
+	pte_t *pt;
+	int i;
+
+	if (__sync_sub_and_fetch(&pp->pp_ref, 1) != 0)
+		return;
+	pt = page2kva(pp);
+	for (i = 0; i < NPTENTRIES; i++)
+		if (pt[i] & PTE_P)
+			page_decref(pa2page(PTE_ADDR(pt[i])));
+	__sync_sub_and_fetch(&pgtable_stats.pages, 1);
+	page_free(pp);
+}
+
+//
+// Resolve a write fault at 'va' in 'pgdir', if the page there is mapped
+// copy-on-write, or lies in a page table shared copy-on-write: give
+// pgdir a private writable copy of the page, or just make the page
+// writable again when no one else maps it any more.
+//
+// RETURNS:
+//   0 if the fault was resolved
+//   -E_INVAL, if va isn't mapped copy-on-write
+//   -E_NO_MEM, if there's no memory for a copy
+//
+int
+page_cow_fault(pde_t *pgdir, void *va)
+{
+	pte_t *pte;
+	struct PageInfo *pp, *np;
+	int perm;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((uintptr_t) va >= UTOP || !(pp = page_lookup(pgdir, va, &pte)))
+		return -E_INVAL;
+	if (!(pgdir[PDX(va)] & PTE_COW) && !(*pte & PTE_COW))
+		return -E_INVAL;
+	if (!(pte = pgdir_walk(pgdir, va, 1)))
+		return -E_NO_MEM;
+	if (*pte & PTE_W)
+		return 0;
+	if (!(*pte & PTE_COW))
+		return -E_INVAL;
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+
+	// A page mapped only here can't gain another mapping behind our
+	// back, since mapping it takes this one.  PTE_COW is a user-settable
+	// bit, but sys_page_map and IPC only let it onto pages the env
+	// could map writable anyway (see perm_allowed), so this grants no
+	// access the env didn't have.
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if (!(np = page_alloc(0)))
+		return -E_NO_MEM;
+	memcpy(page2kva(np), page2kva(pp), PGSIZE);
+	return page_insert(pgdir, np, va, perm);
+}
+
+//
+// Reserve the page at 'va' in 'pgdir' with permissions 'perm' without
+// allocating it: the page table entry keeps 'perm' and PTE_LAZY, but not
+// PTE_P, until page_lazy_fault allocates a zeroed page on first touch.
+// Whatever was mapped at 'va' is removed.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated
+//
+int
+page_reserve(pde_t *pgdir, void *va, int perm)
+{
+	pte_t *pte;
+
+	if (!(pte = pgdir_walk(pgdir, va, 1)))
+		return -E_NO_MEM;
+	if (*pte & PTE_P)
+		page_remove(pgdir, va);
+	*pte = (perm & PTE_SYSCALL & ~PTE_P) | PTE_LAZY;
+	return 0;
+}
+
+//
+// Resolve a fault at 'va' in 'pgdir', if the page there was reserved
+// with page_reserve: map a zeroed page there with the saved permissions.
+//
+// RETURNS:
+//   0 if the fault was resolved
+//   -E_INVAL, if va isn't reserved
+//   -E_NO_MEM, if there's no memory for the page
+//
+int
+page_lazy_fault(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((uintptr_t) va >= UTOP || !(pte = pgdir_walk(pgdir, va, 0))
+	    || (*pte & (PTE_P | PTE_LAZY)) != PTE_LAZY)
+		return -E_INVAL;
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	if (page_insert(pgdir, pp, va, *pte & PTE_SYSCALL) < 0) {
+		page_free(pp);
+		return -E_NO_MEM;
+	}
+	return 0;
+}
+
 //
 // Reserve size bytes in the MMIO region and map [pa,pa+size) at this
 // location.  Return the base of the reserved region.  size does *not*
@@ -635,13 +1295,38 @@ mmio_map_region(physaddr_t pa, size_t size)
 	if (base + size > MMIOLIM){
 		panic("Error in mmio_map_region: base+size > MMIOLIM!\n");
 	}
-	boot_map_region(kern_pgdir,base,size,pa,PTE_PCD|PTE_PWT|PTE_P|PTE_W);
+	boot_map_region(kern_pgdir,base,size,pa,PTE_PCD|PTE_PWT|PTE_P|PTE_W|PTE_G);
 	uintptr_t old_base = base;
 	base += size;
 	return (void *)old_base;
 }
 static uintptr_t user_mem_check_addr;
 
+// Called whenever a user mapping in 'pgdir' is removed or its
+// permissions may have narrowed: empties the env_umem_cache of the env
+// whose page directory it is, and of no other env.
+static void
+umem_invalidate(pde_t *pgdir)
+{
+	if (pgdir != kern_pgdir)
+		__sync_add_and_fetch(&pa2page(PADDR(pgdir))->pp_umem_gen, 1);
+}
+
+// Whether a page table or page directory entry lets a user access its
+// page with 'perm'.  Reserved (PTE_LAZY) pages count as present, and
+// copy-on-write ones as writable, since the kernel fixes either up when
+// it touches them.  A page directory entry never has PTE_LAZY without
+// PTE_P.
+static bool
+user_pte_allows(pte_t pte, int perm)
+{
+	if ((pte & (PTE_P | PTE_LAZY)) == PTE_LAZY)
+		pte |= PTE_P;
+	if (pte & PTE_COW)
+		pte |= PTE_W;
+	return (pte & perm) == perm;
+}
+
 //
 // Check that an environment is allowed to access the range of memory
 // [va, va+len) with permissions 'perm | PTE_P'.
@@ -654,6 +1339,11 @@ static uintptr_t user_mem_check_addr;
 // ULIM, and (2) the page table gives it permission.  These are exactly
 // the tests you should implement here.
 //
+// The page table entries under each page directory entry are checked in
+// one pass.  Pages of short ranges are remembered in env_umem_cache, so
+// that checking the same buffer again, as the network system calls do
+// for every packet, doesn't walk the page tables at all.
+//
 // If there is an error, set the 'user_mem_check_addr' variable to the first
 // erroneous virtual address.
 //
@@ -664,31 +1354,62 @@ int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
 	// LAB 3: Your code here.
-	uint32_t i;
-	uint32_t start = ROUNDDOWN((uint32_t)va,PGSIZE);
-	uint32_t end = ROUNDUP((uint32_t)va + len,PGSIZE);
-	uint32_t idx= 0;
-	for(i = start; i < end; i += PGSIZE){
-		if(i >= ULIM){
+	uintptr_t start = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	uintptr_t end = ROUNDUP((uintptr_t) va + len, PGSIZE);
+	uintptr_t i, last, *cache;
+	uint32_t gen;
+	pde_t pde;
+	pte_t *pt;
+	bool cacheable;
+
+	perm |= PTE_P;
+	if ((uintptr_t) va + len < (uintptr_t) va) {
+		i = start;
+		goto bad;
+	}
+
+	cache = env->env_umem_cache;
+	cacheable = end - start <= UMEM_CACHE_SIZE * PGSIZE;
+	gen = pa2page(PADDR(env->env_pgdir))->pp_umem_gen;
+	if (env->env_umem_gen != gen) {
+		memset(cache, 0, sizeof(env->env_umem_cache));
+		env->env_umem_gen = gen;
+	} else if (cacheable) {
+		for (i = start; i < end; i += PGSIZE)
+			if (PTE_ADDR(cache[PGNUM(i) % UMEM_CACHE_SIZE]) != i
+			    || !user_pte_allows(cache[PGNUM(i) % UMEM_CACHE_SIZE], perm))
+				break;
+		if (i == end)
+			return 0;
+	}
+
+	for (i = start; i < end; ) {
+		if (i >= ULIM)
+			goto bad;
+		pde = env->env_pgdir[PDX(i)];
+		if (!user_pte_allows(pde, perm))
 			goto bad;
+		last = ROUNDDOWN(i, PTSIZE) + PTSIZE;
+		if (pde & PTE_PS) {
+			i = last;
+			continue;
 		}
-		pte_t * pte = pgdir_walk(env->env_pgdir,(void*)i,0);
-		if(!pte) goto bad;
-		if(!(*pte & (perm | PTE_P))) goto bad;
-		idx+=1;
+		if (last > end)
+			last = end;
+		pt = KADDR(PTE_ADDR(pde));
+		for (; i < last; i += PGSIZE)
+			if (!user_pte_allows(pt[PTX(i)], perm))
+				goto bad;
 	}
 
+	if (cacheable)
+		for (i = start; i < end; i += PGSIZE)
+			cache[PGNUM(i) % UMEM_CACHE_SIZE] = i | perm;
 	return 0;
 
-	bad:
-		if (idx == 0){
-				user_mem_check_addr = (uintptr_t)va;
-		}
-		else{
-				user_mem_check_addr = i;
-		}
-		return -E_FAULT;
-
+bad:
+	user_mem_check_addr = i == start ? (uintptr_t) va : i;
+	return -E_FAULT;
 }
 
 //
@@ -857,15 +1578,18 @@ check_page_alloc(void)
 int
 user_mem_phy_addr(struct Env *env, uintptr_t va, physaddr_t *pa_store)
 {
-	int r;
-	if ((r = user_mem_check(env, (void *)va, 0, PTE_U)) < 0) {
-		*pa_store = 0;
-		return r;
-	}
-
-	physaddr_t pa = 0;
 	struct PageInfo *pp;
-	pp = page_lookup(curenv->env_pgdir, (void *)va, 0);
+	pte_t *pte;
+
+	*pa_store = 0;
+	if (va >= ULIM)
+		return -E_FAULT;
+	pp = page_lookup(env->env_pgdir, (void *)va, &pte);
+	// A reserved page needs a physical page first.
+	if (!pp && page_lazy_fault(env->env_pgdir, (void *)va) == 0)
+		pp = page_lookup(env->env_pgdir, (void *)va, &pte);
+	if (!pp || !(*pte & PTE_U))
+		return -E_FAULT;
 	*pa_store = page2pa(pp) | PGOFF(va);
 
 	return 0;
@@ -946,6 +1670,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_ADDR(*pgdir) + (PTX(va) << PTXSHIFT);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -17,6 +17,18 @@ extern size_t npages;
 
 extern pde_t *kern_pgdir;
 
+// Page table usage and the cost of sharing page tables across fork.
+// The cycle counts are updated without a lock, so they are approximate.
+struct PgtableStats {
+	uint32_t pages;		// Page table pages in use
+	uint32_t shared;	// Page tables shared by fork instead of copied
+	uint32_t copied;	// Shared page tables later copied on a change
+	uint32_t forks;		// Calls to pgdir_copy_cow
+	uint64_t fork_cycles;	// Time spent in pgdir_copy_cow
+	uint64_t copy_cycles;	// Time spent copying shared page tables
+};
+extern struct PgtableStats pgtable_stats;
+
 
 /* This macro takes a kernel virtual address -- an address that points above
  * KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
@@ -51,17 +63,32 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// Largest block page_alloc_order hands out: 2^10 pages, or 4MB.
+#define MAX_PAGE_ORDER	10
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
+void	page_zero_idle(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 int	user_mem_phy_addr(struct Env *env, uintptr_t va, physaddr_t *pa_store);
 void	tlb_invalidate(pde_t *pgdir, void *va);
+int	pgdir_copy_cow(pde_t *dstpgdir, pde_t *srcpgdir, uintptr_t end);
+int	pgdir_unshare(pde_t *pgdir, const void *va);
+void	pgtable_decref(struct PageInfo *pp);
+int	page_cow_fault(pde_t *pgdir, void *va);
+int	page_reserve(pde_t *pgdir, void *va, int perm);
+int	page_lazy_fault(pde_t *pgdir, void *va);
+void	page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+void	pde_remove(pde_t *pgdir, void *va);
+int	pgdir_split_large(pde_t *pgdir, const void *va);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
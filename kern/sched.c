@@ -4,6 +4,8 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/time.h>
 
 void sched_halt(void);
 void train_classifier(){
@@ -52,68 +54,323 @@ void train_classifier(){
 	}
 	classifier_ready = true;
 }
-// Choose a user environment to run and run it.
+// Each CPU keeps its own FIFO ready queues of ENV_RUNNABLE envs, one
+// per priority, so picking the next env to run never has to walk the
+// whole 'envs' array.  The highest-priority non-empty queue always
+// wins; within a priority, envs take turns, each running for
+// env_weight timer ticks before it is preempted.
+//
+// An env is queued on its home CPU, the CPU it last ran on
+// (env_cpunum), so it tends to keep running where its cache lines
+// already are.  A CPU that runs out of local work steals a batch of
+// envs from the busiest other CPU before it considers halting.
+//
+// Entries are removed lazily: an env whose status changed after it was
+// queued (it was destroyed, went back to ENV_NOT_RUNNABLE, or was run
+// directly by someone else) simply stays linked until it reaches the
+// head of its queue, where runq_pop discards it.  env_rq_queued says
+// whether an env is currently linked, so an env is never on two queues.
+
+static void
+runq_push(struct CpuInfo *cpu, struct Env *e)
+{
+	int prio = e->env_priority;
+
+	e->env_rq_link = NULL;
+	e->env_rq_queued = true;
+	if (cpu->cpu_rq_tail[prio])
+		cpu->cpu_rq_tail[prio]->env_rq_link = e;
+	else
+		cpu->cpu_rq_head[prio] = e;
+	cpu->cpu_rq_tail[prio] = e;
+	cpu->cpu_rq_len++;
+}
+
+// Remove envs from the head of cpu's highest-priority ready queue
+// until one that is still ENV_RUNNABLE turns up, and return it.
+// Returns NULL if all of cpu's queues run dry.
+static struct Env *
+runq_pop(struct CpuInfo *cpu)
+{
+	struct Env *e;
+	int prio;
+
+	for (prio = NENVPRIO - 1; prio >= 0; prio--) {
+		while ((e = cpu->cpu_rq_head[prio]) != NULL) {
+			cpu->cpu_rq_head[prio] = e->env_rq_link;
+			if (!cpu->cpu_rq_head[prio])
+				cpu->cpu_rq_tail[prio] = NULL;
+			cpu->cpu_rq_len--;
+			e->env_rq_link = NULL;
+			e->env_rq_queued = false;
+			if (e->env_status == ENV_RUNNABLE)
+				return e;
+		}
+	}
+	return NULL;
+}
+
+// Is anything queued on cpu with a priority above 'prio'?
+static bool
+runq_has_higher(struct CpuInfo *cpu, int prio)
+{
+	for (prio++; prio < NENVPRIO; prio++)
+		if (cpu->cpu_rq_head[prio])
+			return true;
+	return false;
+}
+
+// Envs blocked in sys_sleep_until, kept in a min-heap on
+// env_sleep_until so the earliest deadline is always sleepers[1].
+// env_sleep_idx is an env's index in sleepers[], or 0 if it is not
+// sleeping.  Timer interrupts wake the envs whose deadline has passed,
+// and each CPU arms its timer no later than sleepers[1]'s deadline.
+static struct Env *sleepers[NENV + 1];
+static int nsleepers;
+
+static void
+sleep_swap(int i, int j)
+{
+	struct Env *e = sleepers[i];
+
+	sleepers[i] = sleepers[j];
+	sleepers[j] = e;
+	sleepers[i]->env_sleep_idx = i;
+	sleepers[j]->env_sleep_idx = j;
+}
+
+static void
+sleep_up(int i)
+{
+	for (; i > 1; i /= 2) {
+		if (sleepers[i / 2]->env_sleep_until <= sleepers[i]->env_sleep_until)
+			break;
+		sleep_swap(i, i / 2);
+	}
+}
+
+static void
+sleep_down(int i)
+{
+	int c;
+
+	while ((c = 2 * i) <= nsleepers) {
+		if (c + 1 <= nsleepers &&
+		    sleepers[c + 1]->env_sleep_until < sleepers[c]->env_sleep_until)
+			c++;
+		if (sleepers[i]->env_sleep_until <= sleepers[c]->env_sleep_until)
+			break;
+		sleep_swap(i, c);
+		i = c;
+	}
+}
+
+// Block 'e' until time_msec() reaches 'deadline'.
 void
-sched_yield(void)
+sched_sleep(struct Env *e, uint32_t deadline)
 {
-	struct Env *idle;
+	e->env_status = ENV_NOT_RUNNABLE;
+	e->env_sleep_until = deadline;
+	sleepers[++nsleepers] = e;
+	e->env_sleep_idx = nsleepers;
+	sleep_up(nsleepers);
+}
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
+// Take 'e' off the sleep heap, if it is on it.
+void
+sched_sleep_cancel(struct Env *e)
+{
+	int i = e->env_sleep_idx;
+
+	if (!i)
+		return;
+	sleep_swap(i, nsleepers);
+	nsleepers--;
+	e->env_sleep_idx = 0;
+	if (i <= nsleepers) {
+		sleep_up(i);
+		sleep_down(i);
+	}
+}
+
+// Make runnable every sleeper whose deadline has passed.
+static void
+sleep_wakeup(void)
+{
+	uint32_t now = time_msec();
 
-	// LAB 4: Your code here.
+	while (nsleepers && sleepers[1]->env_sleep_until <= now)
+		sched_enqueue(sleepers[1]);
+}
+
+// Arm this CPU's timer for whichever comes first: the end of curenv's
+// current tick, or the earliest sleeper's deadline.  An idle CPU only
+// waits for the deadline.
+static void
+sched_arm_timer(void)
+{
+	uint64_t now = time_usec(), wake = 0, t;
 
+	if (curenv)
+		wake = thiscpu->cpu_tick_end;
+	if (nsleepers) {
+		t = (uint64_t) sleepers[1]->env_sleep_until * 1000;
+		if (!wake || t < wake)
+			wake = t;
+	}
+	if (!wake)
+		lapic_timer_oneshot(0);
+	else if (wake <= now)
+		lapic_timer_oneshot(1);
+	else
+		lapic_timer_oneshot(wake - now);
+}
 
+// Start a new SCHED_QUANTUM_US tick for curenv on this CPU.
+void
+sched_start_tick(void)
+{
+	thiscpu->cpu_tick_end = time_usec() + SCHED_QUANTUM_US;
+	sched_arm_timer();
+}
 
-		int32_t id,i;
+// Wake one halted CPU other than this one, if there is any.
+static void
+sched_wake_idle(void)
+{
+	int i;
 
-		if (!curenv){
-			id = -1 ;
-		}
-		else{
-			id = ENVX(curenv->env_id);
+	for (i = 0; i < ncpu; i++)
+		if (&cpus[i] != thiscpu && cpus[i].cpu_status == CPU_HALTED) {
+			lapic_ipi_cpu(cpus[i].cpu_id, T_WAKEUP);
+			return;
 		}
+}
 
-		for(i=id+1;i<NENV;i++){
-			if(envs[i].env_status == ENV_RUNNABLE){
-				env_run(&envs[i]); //ContextSwitch
+// Mark 'e' runnable and append it to its home CPU's ready queue.
+// An env that has never run yet starts out on this CPU.
+void
+sched_enqueue(struct Env *e)
+{
+	struct CpuInfo *cpu;
 
-				return; //Should not return
-			}
-		}
-		for(i=0;i<id;i++){
-			if(envs[i].env_status == ENV_RUNNABLE){
-				env_run(&envs[i]); //ContextSwitch
-				return; //Should not return
-			}
-		}
-		if(curenv && curenv->env_status == ENV_RUNNING){
-			env_run(curenv); //ContextSwich
+	sched_sleep_cancel(e);
+	e->env_status = ENV_RUNNABLE;
+	if (e->env_rq_queued)
+		return;
 
-			return; //Should not return
-		}
+	if (e->env_runs == 0)
+		cpu = thiscpu;
+	else
+		cpu = &cpus[e->env_cpunum];
+	runq_push(cpu, e);
 
+	// Idle CPUs sleep without a timer, so poke them: the home CPU
+	// if it is asleep, or else any sleeping CPU once there is more
+	// work here than one CPU can run, so it can steal some.
+	if (cpu != thiscpu && cpu->cpu_status == CPU_HALTED)
+		lapic_ipi_cpu(cpu->cpu_id, T_WAKEUP);
+	else if (cpu->cpu_rq_len > 1)
+		sched_wake_idle();
+}
 
+// Move up to half of the busiest other CPU's ready queues onto this
+// CPU's queues, highest priority first.  Stale entries met on the way
+// are dropped.
+// Returns false if every other CPU's queue is empty.
+static bool
+sched_steal(void)
+{
+	struct CpuInfo *victim = NULL;
+	struct Env *e;
+	int i, n, moved;
+
+	for (i = 0; i < ncpu; i++)
+		if (&cpus[i] != thiscpu && cpus[i].cpu_rq_len > 0 &&
+		    (!victim || cpus[i].cpu_rq_len > victim->cpu_rq_len))
+			victim = &cpus[i];
+	if (!victim)
+		return false;
+
+	n = (victim->cpu_rq_len + 1) / 2;
+	for (moved = 0; moved < n && (e = runq_pop(victim)) != NULL; moved++) {
+		// The env's home is now here, so wakeups follow it.
+		e->env_cpunum = cpunum();
+		runq_push(thiscpu, e);
+	}
+	return true;
+}
+
+// Give 'e' a fresh time slice and run it.
+static void
+sched_run(struct Env *e)
+{
+	e->env_slice = e->env_weight;
+	// env_run starts a tick itself when it switches envs.
+	if (e == curenv)
+		sched_start_tick();
+	env_run(e);
+}
+
+// Choose a user environment to run and run it.
+void
+sched_yield(void)
+{
+	struct Env *e;
+
+	// Round-robin: the env this CPU was running goes to the back of
+	// its queue, behind everything that became runnable meanwhile.
+	// If nothing else is runnable it is simply popped again.
+	//
+	// Envs running on other CPUs are ENV_RUNNING and never on a
+	// queue, so they can't be chosen here.
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		sched_enqueue(curenv);
+
+	if ((e = runq_pop(thiscpu)) != NULL)
+		sched_run(e);
+
+	// Nothing queued locally; take work from another CPU rather
+	// than halting while envs are waiting.  The victim's queue may
+	// hold only stale entries, so keep going until all are empty.
+	while (sched_steal())
+		if ((e = runq_pop(thiscpu)) != NULL)
+			sched_run(e);
 
 	// sched_halt never returns
 	sched_halt();
+	panic("sched_halt returned");  /* mostly to placate the compiler */
 }
 
+// Called on every timer interrupt.  Wakes sleepers whose deadline has
+// passed.  Returns if curenv should keep the CPU: its current tick has
+// not ended yet (the interrupt was for a sleeper), or it still has
+// ticks left in its slice and no higher-priority env is waiting here.
+// Otherwise reschedules and does not return.
+void
+sched_tick(void)
+{
+	sleep_wakeup();
+	if (curenv && curenv->env_status == ENV_RUNNING) {
+		if (time_usec() < thiscpu->cpu_tick_end) {
+			sched_arm_timer();
+			return;
+		}
+		if (curenv->env_slice > 1 &&
+		    !runq_has_higher(thiscpu, curenv->env_priority)) {
+			curenv->env_slice--;
+			sched_start_tick();
+			return;
+		}
+	}
+	sched_yield();
+}
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+
+// Halt this CPU when there is nothing to do. The timer is only armed
+// for the next sleeper's deadline; otherwise the CPU sleeps until a
+// device interrupt or until sched_enqueue wakes it with T_WAKEUP.
+// This function never returns.
 //
 void
 sched_halt(void)
@@ -139,6 +396,7 @@ sched_halt(void)
 	// Mark that no environment is running on this CPU
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
+	sched_arm_timer();
 	/* Train our classifier: */
 	if (cpunum() == 0){
 			train_classifier();
@@ -154,6 +412,9 @@ sched_halt(void)
 	// Release the big kernel lock as if we were "leaving" the kernel
 	unlock_kernel();
 
+	// Use the idle time to zero pages for later ALLOC_ZERO allocations.
+	page_zero_idle();
+
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
 		"movl $0, %%ebp\n"
@@ -6,7 +6,19 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+struct Env;
+
+// Length of one timer tick of a time slice, in microseconds.
+#define SCHED_QUANTUM_US	10000
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_enqueue(struct Env *e);
+void sched_tick(void);
+void sched_start_tick(void);
+void sched_sleep(struct Env *e, uint32_t deadline);
+void sched_sleep_cancel(struct Env *e);
 
 #endif	// !JOS_KERN_SCHED_H
@@ -11,11 +11,11 @@
 
 // The big kernel lock
 struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
 	.name = "kernel_lock"
-#endif
 };
 
+struct spinlock *spinlock_list;
+
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -39,20 +39,39 @@ get_caller_pcs(uint32_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->owner != lock->next && lock->cpu == thiscpu;
 }
 #endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	lk->next = 0;
+	lk->owner = 0;
 	lk->name = name;
+	lk->acquisitions = 0;
+	lk->contended = 0;
+	lk->spin_cycles = 0;
+	lk->stat_link = 0;
+	lk->stat_listed = 0;
+#ifdef DEBUG_SPINLOCK
 	lk->cpu = 0;
 #endif
 }
 
+// Add lk to spinlock_list, so the monitor can find its statistics.
+// Lock-free, since the list has no lock of its own to take.
+static void
+spin_list_add(struct spinlock *lk)
+{
+	struct spinlock *head;
+
+	do {
+		head = spinlock_list;
+		lk->stat_link = head;
+	} while (!__sync_bool_compare_and_swap(&spinlock_list, head, lk));
+}
+
 // Acquire the lock.
 // Loops (spins) until the lock is acquired.
 // Holding a lock for a long time may cause
@@ -60,16 +79,31 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	unsigned ticket;
+	uint64_t start;
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
+	// The locked xadd is atomic.
 	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	// reordered before it.
+	ticket = __sync_fetch_and_add(&lk->next, 1);
+	if (lk->owner != ticket) {
+		start = read_tsc();
+		while (lk->owner != ticket)
+			asm volatile ("pause");
+		lk->contended++;
+		lk->spin_cycles += read_tsc() - start;
+	}
+	asm volatile ("" ::: "memory");
+	lk->acquisitions++;
+	if (!lk->stat_listed) {
+		lk->stat_listed = 1;
+		spin_list_add(lk);
+	}
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -113,8 +147,10 @@ spin_unlock(struct spinlock *lk)
 	// any order, which implies we need to serialize here.
 	// But the 2007 Intel 64 Architecture Memory Ordering White
 	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
+	// after a store. So a plain increment would work here.
 	// The xchg being asm volatile ensures gcc emits it after
 	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+	// Only the holder writes owner, so handing the lock to the
+	// next ticket needs no read-modify-write.
+	xchg(&lk->owner, lk->owner + 1);
 }
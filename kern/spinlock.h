@@ -2,17 +2,29 @@
 #define JOS_INC_SPINLOCK_H
 
 #include <inc/types.h>
+#include <kern/cpu.h>
 
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
 // Mutual exclusion lock.
+// A ticket lock: each CPU takes the next ticket and spins until
+// 'owner' reaches it, so waiters are served in FIFO order.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile unsigned next;  // Next ticket to hand out
+	volatile unsigned owner; // Ticket of the current holder
+	char *name;            // Name of lock.
+
+	// Contention statistics, only updated by the lock holder.
+	// See the lockstat monitor command.
+	uint64_t acquisitions; // Times the lock was acquired
+	uint64_t contended;    // Acquisitions that had to wait
+	uint64_t spin_cycles;  // TSC cycles spent waiting
+	struct spinlock *stat_link; // Next lock in spinlock_list
+	unsigned stat_listed;  // On spinlock_list yet?
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;            // Name of lock.
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
@@ -27,15 +39,20 @@ void spin_unlock(struct spinlock *lk);
 
 extern struct spinlock kernel_lock;
 
+// All locks that have been acquired at least once, linked by stat_link.
+extern struct spinlock *spinlock_list;
+
 static inline void
 lock_kernel(void)
 {
 	spin_lock(&kernel_lock);
+	thiscpu->cpu_kernel_locked = true;
 }
 
 static inline void
 unlock_kernel(void)
 {
+	thiscpu->cpu_kernel_locked = false;
 	spin_unlock(&kernel_lock);
 
 	// Normally we wouldn't need to do this, but QEMU only runs
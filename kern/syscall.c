@@ -15,6 +15,10 @@
 #include <kern/time.h>
 #include <kern/e1000.h>
 
+// Returned (negated) by system calls that found they cannot go on
+// without the big kernel lock; syscall_nolock() then lets trap() retry
+// them the usual way.  User environments never see it.
+#define E_KERNEL_LOCK	(MAXERROR + 1)
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -99,6 +103,15 @@ sys_exofork(void)
   memcpy(&new_env->env_tf,&curenv->env_tf,sizeof(struct Trapframe));
 	new_env->env_tf.tf_regs.reg_eax = 0;
 	new_env->env_status = ENV_NOT_RUNNABLE;
+	// The child inherits its parent's scheduling class, except that
+	// forked envs are always ENV_TYPE_USER, which may not hold
+	// ENV_PRIO_SERVER (see sys_env_set_priority): a server's children,
+	// such as the network server's timer and input envs, keep
+	// env_alloc's defaults.
+	if (curenv->env_priority != ENV_PRIO_SERVER) {
+		new_env->env_priority = curenv->env_priority;
+		new_env->env_weight = curenv->env_weight;
+	}
 	return new_env->env_id;
 }
 
@@ -123,7 +136,54 @@ sys_env_set_status(envid_t envid, int status)
 	struct Env* env_to_change;
 	int res = envid2env(envid,&env_to_change,1);
 	if(res < 0) return -E_BAD_ENV;
-	env_to_change->env_status = status;
+	if(status == ENV_RUNNABLE)
+		sched_enqueue(env_to_change);
+	else
+		env_to_change->env_status = status;
+	return 0;
+}
+
+// Set envid's scheduling priority and weight.
+// 'priority' is one of ENV_PRIO_*; ENV_PRIO_SERVER may only be given to
+// the special (non-ENV_TYPE_USER) environments.  'weight' is the number
+// of timer ticks envid runs before yielding to an env of equal priority,
+// between 1 and ENV_WEIGHT_MAX.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if priority or weight is out of range.
+static int
+sys_env_set_priority(envid_t envid, int priority, uint32_t weight)
+{
+	struct Env *e;
+
+	if (priority < 0 || priority >= NENVPRIO) return -E_INVAL;
+	if (weight < 1 || weight > ENV_WEIGHT_MAX) return -E_INVAL;
+	if (envid2env(envid, &e, 1) < 0) return -E_BAD_ENV;
+	if (priority == ENV_PRIO_SERVER && e->env_type == ENV_TYPE_USER)
+		return -E_INVAL;
+	e->env_priority = priority;
+	e->env_weight = weight;
+	return 0;
+}
+
+// Called with e's lock held, after looking e up by 'envid' with
+// envid2env.  Checks that e was not freed before we got its lock, and,
+// when running without the big kernel lock, that e is not running on
+// another CPU, where the kernel might be using its address space.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_KERNEL_LOCK if the big kernel lock is needed to change e.
+static int
+env_check_locked(struct Env *e, envid_t envid)
+{
+	if (e->env_status == ENV_FREE || (envid && e->env_id != envid))
+		return -E_BAD_ENV;
+	if (!thiscpu->cpu_kernel_locked && e != curenv &&
+	    (e->env_status == ENV_RUNNING || e->env_status == ENV_DYING))
+		return -E_KERNEL_LOCK;
 	return 0;
 }
 
@@ -179,6 +239,8 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         PTE_LAZY may also be set, to only reserve the page: the kernel
+//         allocates it on first touch (see page_reserve).
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
@@ -198,20 +260,86 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	//   allocated!
 
 	// LAB 4: Your code here.
-	if(((perm & (~PTE_SYSCALL)) != 0) ||
+	if(((perm & ~(PTE_SYSCALL | PTE_LAZY)) != 0) ||
 	 	!(perm & PTE_P) || (!(perm & PTE_U))) return -E_INVAL;
 	if((uint32_t)va >= UTOP || va != ROUNDDOWN(va, PGSIZE) ) return -E_INVAL;
 	struct Env* env;
 	int res = envid2env(envid,&env,1);
 	if(res < 0) return -E_BAD_ENV;
+	env_lock(env);
+	if((res = env_check_locked(env, envid)) < 0) goto out;
+	if(perm & PTE_LAZY) {
+		res = page_reserve(env->env_pgdir, va, perm);
+		goto out;
+	}
 	struct PageInfo* pagey = page_alloc(ALLOC_ZERO);
-	if(!pagey) return -E_NO_MEM;
+	if(!pagey) {
+		res = -E_NO_MEM;
+		goto out;
+	}
 	res = page_insert(env->env_pgdir, pagey, va, perm);
 	if(res < 0){
 		page_free(pagey);
-		return -E_NO_MEM;
+		res = -E_NO_MEM;
 	}
-	return 0;
+out:
+	env_unlock(env);
+	return res;
+}
+
+// Allocate 4MB of zeroed, physically contiguous memory and map it at 'va'
+// in envid's address space as a single large page, so that the region
+// takes one TLB entry rather than a thousand.  Whatever was mapped in
+// [va, va+PTSIZE) before is unmapped.  The pages can still be mapped,
+// unmapped and shared 4KB at a time afterwards; doing so splits the
+// mapping back into 4KB pages.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not PTSIZE-aligned, or the region would reach
+//		into the stacks' page table (va + PTSIZE > UTOP - PTSIZE).
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there's no free 4MB block of memory.
+static int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	struct PageInfo *pp;
+	struct Env *env;
+	int r;
+
+	if ((perm & ~PTE_SYSCALL) || !(perm & PTE_P) || !(perm & PTE_U))
+		return -E_INVAL;
+	if ((uint32_t) va >= UTOP - PTSIZE || va != ROUNDDOWN(va, PTSIZE))
+		return -E_INVAL;
+	if (envid2env(envid, &env, 1) < 0)
+		return -E_BAD_ENV;
+	env_lock(env);
+	if ((r = env_check_locked(env, envid)) < 0)
+		goto out;
+	if (!(pp = page_alloc_order(MAX_PAGE_ORDER, ALLOC_ZERO))) {
+		r = -E_NO_MEM;
+		goto out;
+	}
+	page_insert_large(env->env_pgdir, pp, va, perm);
+out:
+	env_unlock(env);
+	return r;
+}
+
+// Whether a page mapped with 'pte' may be mapped again with 'perm'.
+// PTE_W needs a writable page.  So, nearly, does PTE_COW, since
+// page_cow_fault makes a copy-on-write page that no one else maps
+// writable in place: it needs a page that is writable or already
+// copy-on-write.
+static bool
+perm_allowed(pte_t pte, int perm)
+{
+	if ((perm & PTE_W) && !(pte & PTE_W))
+		return false;
+	if ((perm & PTE_COW) && !(pte & (PTE_W | PTE_COW)))
+		return false;
+	return true;
 }
 
 // Map the page of memory at 'srcva' in srcenvid's address space
@@ -229,6 +357,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if (perm & PTE_COW), but srcva is neither writable nor
+//		copy-on-write in srcenvid's address space.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
@@ -254,17 +384,36 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	res = envid2env(dstenvid,&dst_env,1);
 	if(res < 0) return -E_BAD_ENV;
 
+	// Take both locks in envs[] order, so two CPUs mapping between
+	// the same pair of envs cannot deadlock.
+	struct Env* first = src_env < dst_env ? src_env : dst_env;
+	struct Env* second = src_env < dst_env ? dst_env : src_env;
+	env_lock(first);
+	if(second != first) env_lock(second);
+	if((res = env_check_locked(src_env, srcenvid)) < 0 ||
+	   (res = env_check_locked(dst_env, dstenvid)) < 0)
+		goto out;
+
+	// A page table shared with a fork relative says nothing about
+	// whether the page is writable; take a private copy first.
+	if((perm & PTE_W) && (res = pgdir_unshare(src_env->env_pgdir, srcva)) < 0)
+		goto out;
+	// A reserved page gets allocated now, so that there's one to share.
+	if((res = page_lazy_fault(src_env->env_pgdir, srcva)) == -E_NO_MEM)
+		goto out;
 	//Page lookup
 	pte_t* pte_store;
 	struct PageInfo* pagey = page_lookup(src_env->env_pgdir, srcva,&pte_store);
-	if(!pagey) return -E_INVAL;
-	if(!(*pte_store & PTE_W) && (perm & PTE_W)) return -E_INVAL;
+	res = -E_INVAL;
+	if(!pagey) goto out;
+	if(!perm_allowed(*pte_store, perm)) goto out;
 	//Page insert
 	res = page_insert(dst_env->env_pgdir, pagey, dstva, perm);
-	if(res < 0){
-		return -E_NO_MEM;
-	}
-	return 0;
+	if(res < 0) res = -E_NO_MEM;
+out:
+	if(second != first) env_unlock(second);
+	env_unlock(first);
+	return res;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -284,10 +433,267 @@ sys_page_unmap(envid_t envid, void *va)
 	struct Env* env;
 	int res = envid2env(envid,&env,1);
 	if(res < 0) return -E_BAD_ENV;
-	page_remove(env->env_pgdir,va);
+	env_lock(env);
+	if((res = env_check_locked(env, envid)) == 0)
+		page_remove(env->env_pgdir,va);
+	env_unlock(env);
+	return res;
+}
+
+// Create a copy-on-write child of the current environment in one step.
+// The child's user mappings are copied straight from our page tables,
+// with writable pages made read-only PTE_COW in both, and the kernel
+// resolves either side's write faults itself (see page_cow_fault).
+// The child gets a fresh user exception stack and our upcalls, and is
+// left runnable, with sys_fork returning 0 in it.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+	struct Env *child;
+	int r;
+
+	if ((r = sys_exofork()) < 0)
+		return r;
+	child = &envs[ENVX(r)];
+	memcpy(child->env_upcalls, curenv->env_upcalls,
+	       sizeof(child->env_upcalls));
+
+	// The exception stack is never shared, so stop short of it.
+	r = pgdir_copy_cow(child->env_pgdir, curenv->env_pgdir,
+			   UXSTACKTOP - PGSIZE);
+	// Our writable mappings may have just become read-only.
+	lcr3(PADDR(curenv->env_pgdir));
+	if (r < 0)
+		goto bad;
+	if (page_lookup(curenv->env_pgdir, (void *) (UXSTACKTOP - PGSIZE), 0)
+	    && (r = sys_page_alloc(child->env_id, (void *) (UXSTACKTOP - PGSIZE),
+				   PTE_P | PTE_U | PTE_W)) < 0)
+		goto bad;
+
+	sched_enqueue(child);
+	return child->env_id;
+
+bad:
+	env_destroy(child);
+	return r;
+}
+
+// Apply the 'n' page operations in 'ops' in order, exactly as if each
+// had been made as its own sys_page_alloc, sys_page_map or sys_page_unmap
+// call, but for the price of a single kernel entry.
+// Stops at the first operation that fails; the ones before it stay done.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if n < 0, or an operation is not readable user memory
+//		(an earlier operation may have unmapped it) or has an
+//		unknown op.
+//	Any error returned by the failing operation's system call.
+static int
+sys_page_batch(const struct PageOp *ops, int n)
+{
+	struct PageOp op;
+	int i, r;
+
+	if (n < 0)
+		return -E_INVAL;
+	for (i = 0; i < n; i++) {
+		if (user_mem_check(curenv, &ops[i], sizeof(op), PTE_U) < 0)
+			return -E_INVAL;
+		op = ops[i];
+		switch (op.op) {
+		case PAGEOP_ALLOC:
+			r = sys_page_alloc(op.envid, op.va, op.perm);
+			break;
+		case PAGEOP_MAP:
+			r = sys_page_map(op.envid, op.va, op.dstenvid, op.dstva,
+					 op.perm);
+			break;
+		case PAGEOP_UNMAP:
+			r = sys_page_unmap(op.envid, op.va);
+			break;
+		default:
+			r = -E_INVAL;
+		}
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+// Check the page-passing arguments of an IPC send (see
+// sys_ipc_try_send).  Returns 0 if they are fine, or -E_INVAL.
+static int
+ipc_check(void *srcva, unsigned perm)
+{
+	if ((uint32_t)srcva >= UTOP)
+		return 0;
+	if (((perm & (~PTE_SYSCALL)) != 0) ||
+	    !(perm & PTE_P) || (!(perm & PTE_U)))
+		return -E_INVAL;
+	if (srcva != ROUNDDOWN(srcva, PGSIZE))
+		return -E_INVAL;
+	return 0;
+}
+
+// Deliver an IPC from 'src' to 'dst', which is receiving: map the page
+// at 'srcva' in src, if srcva is below UTOP, at dst's env_ipc_dstva, if
+// dst wants a page, and fill in dst's env_ipc fields.  The arguments have passed ipc_check.
+// Nothing changes if the page can't be passed.
+// Returns 0 on success, < 0 on error (see sys_ipc_try_send).
+static int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value,
+	    void *srcva, unsigned perm)
+{
+	struct PageInfo *pp;
+	pte_t *src_pte;
+	unsigned new_perm = 0;
+	int r = 0;
+
+	//Handling Page Sending
+	if ((uint32_t)srcva < UTOP) {
+		env_lock(src);
+		pp = NULL;
+		if ((perm & PTE_W) && pgdir_unshare(src->env_pgdir, srcva) < 0)
+			r = -E_NO_MEM;
+		else if (page_lazy_fault(src->env_pgdir, srcva) == -E_NO_MEM)
+			r = -E_NO_MEM;
+		else if (!(pp = page_lookup(src->env_pgdir, srcva, &src_pte)))
+			r = -E_INVAL;
+		else if (!perm_allowed(*src_pte, perm))
+			r = -E_INVAL;
+		// Hold the page until it is mapped in dst.
+		if (r == 0)
+			__sync_add_and_fetch(&pp->pp_ref, 1);
+		env_unlock(src);
+		if (r < 0)
+			return r;
+
+		if ((uint32_t)dst->env_ipc_dstva < UTOP) {
+			//Page insert
+			env_lock(dst);
+			r = page_insert(dst->env_pgdir, pp, dst->env_ipc_dstva, perm);
+			env_unlock(dst);
+			if (r == 0)
+				new_perm = perm;
+		}//Else, continue
+		page_decref(pp);
+		if (r < 0)
+			return -E_NO_MEM;
+	}
+	//Handling Value Sending
+
+	//    env_ipc_recving is set to 0 to block future sends;
+	dst->env_ipc_recving = 0;
+	//    env_ipc_from is set to the sending envid;
+	dst->env_ipc_from = src->env_id;
+	//    env_ipc_value is set to the 'value' parameter;
+	dst->env_ipc_value = value;
+	//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+	dst->env_ipc_perm = new_perm;
+	dst->env_ipc_npages = new_perm ? 1 : 0;
+	return 0;
+}
+
+// Take a reference to each of the 'npages' pages of curenv at the
+// addresses in the user array 'srcvas', storing them in 'pages', for a
+// vectored IPC.  Each page must pass ipc_check and be mappable with
+// 'perm' as in ipc_deliver.  Nothing is held if any page fails.
+// Returns 0 on success, < 0 on error (see sys_ipc_sendv).
+static int
+ipc_pin(void **srcvas, size_t npages, unsigned perm, struct PageInfo **pages)
+{
+	void *vas[IPC_MAXPAGES];
+	pte_t *pte;
+	size_t i;
+	int r = 0;
+
+	if (npages == 0 || npages > IPC_MAXPAGES)
+		return -E_INVAL;
+	// Copy the list before locking: reading it may fault in a page.
+	user_mem_assert(curenv, srcvas, npages * sizeof(void *), PTE_U);
+	memcpy(vas, srcvas, npages * sizeof(void *));
+
+	env_lock(curenv);
+	for (i = 0; i < npages; i++) {
+		if ((uint32_t)vas[i] >= UTOP || ipc_check(vas[i], perm) < 0)
+			r = -E_INVAL;
+		else if ((perm & PTE_W) && pgdir_unshare(curenv->env_pgdir, vas[i]) < 0)
+			r = -E_NO_MEM;
+		else if (page_lazy_fault(curenv->env_pgdir, vas[i]) == -E_NO_MEM)
+			r = -E_NO_MEM;
+		else if (!(pages[i] = page_lookup(curenv->env_pgdir, vas[i], &pte)))
+			r = -E_INVAL;
+		else if (!perm_allowed(*pte, perm))
+			r = -E_INVAL;
+		if (r < 0)
+			break;
+		__sync_add_and_fetch(&pages[i]->pp_ref, 1);
+	}
+	env_unlock(curenv);
+
+	if (r < 0)
+		while (i-- > 0)
+			page_decref(pages[i]);
+	return r;
+}
+
+// Like ipc_deliver, but map the 'npages' pages held in 'pages' at
+// consecutive addresses from dst's env_ipc_dstva, as many as dst asked
+// for, and set dst's env_ipc_npages to the number mapped.  The caller
+// still holds the pages afterwards.
+// Returns 0 on success, -E_NO_MEM if dst is out of memory, in which
+// case the pages mapped so far are unmapped again.
+static int
+ipc_deliver_pages(struct Env *src, struct Env *dst, uint32_t value,
+		  struct PageInfo **pages, size_t npages, unsigned perm)
+{
+	size_t i, n = 0;
+
+	if ((uint32_t)dst->env_ipc_dstva < UTOP)
+		n = MIN(npages, dst->env_ipc_npages);
+
+	env_lock(dst);
+	for (i = 0; i < n; i++)
+		if (page_insert(dst->env_pgdir, pages[i],
+				dst->env_ipc_dstva + i * PGSIZE, perm) < 0) {
+			while (i-- > 0)
+				page_remove(dst->env_pgdir,
+					    dst->env_ipc_dstva + i * PGSIZE);
+			env_unlock(dst);
+			return -E_NO_MEM;
+		}
+	env_unlock(dst);
+
+	dst->env_ipc_recving = 0;
+	dst->env_ipc_from = src->env_id;
+	dst->env_ipc_value = value;
+	dst->env_ipc_perm = n ? perm : 0;
+	dst->env_ipc_npages = n;
 	return 0;
 }
 
+// Block curenv on dst's queue of senders until dst calls sys_ipc_recv,
+// which delivers the send recorded in curenv's env_ipc_send fields and
+// wakes us with the result.
+static void __attribute__((noreturn))
+ipc_block_sender(struct Env *dst)
+{
+	curenv->env_ipc_send_to = dst;
+	curenv->env_ipc_send_link = NULL;
+	if (dst->env_ipc_senders)
+		dst->env_ipc_senders_tail->env_ipc_send_link = curenv;
+	else
+		dst->env_ipc_senders = curenv;
+	dst->env_ipc_senders_tail = curenv;
+
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -334,68 +740,274 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	struct Env * dst_env;
 	r = envid2env(envid,&dst_env,0);
 	if(r<0) return -E_BAD_ENV;
+	if((r = ipc_check(srcva, perm)) < 0) return r;
 	if(dst_env->env_ipc_recving != 1) return -E_IPC_NOT_RECV;
+	if((r = ipc_deliver(curenv, dst_env, value, srcva, perm)) < 0) return r;
 
-	pte_t *src_pte;
-	unsigned new_perm = 0;
-	//Handling Page Sending
-	if((uint32_t)srcva < UTOP){
-
-		if(((perm & (~PTE_SYSCALL)) != 0) ||
-		 	!(perm & PTE_P) || (!(perm & PTE_U))) return -E_INVAL;
-		if(srcva != ROUNDDOWN(srcva, PGSIZE) ) return -E_INVAL;
-		struct PageInfo * pp = page_lookup(curenv->env_pgdir, srcva, &src_pte);
-		if(!pp) return -E_INVAL;
-		if ((perm & PTE_W) && !(*src_pte & PTE_W)) return -E_INVAL;
-
-		if ((uint32_t)dst_env->env_ipc_dstva < UTOP){
-			//Page insert
-			r = page_insert(dst_env->env_pgdir, pp, dst_env->env_ipc_dstva, perm);
-			if(r < 0)	return -E_NO_MEM;
-			new_perm = perm;
-		}//Else, continue
-	}
-	//Handling Value Sending
-
-	//    env_ipc_recving is set to 0 to block future sends;
-	dst_env->env_ipc_recving = 0;
-	//    env_ipc_from is set to the sending envid;
-	dst_env->env_ipc_from = curenv->env_id;
-	//    env_ipc_value is set to the 'value' parameter;
-	dst_env->env_ipc_value = value;
-	//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
-	dst_env->env_ipc_perm = new_perm;
 	// The target envireonment is marked runnable again, returning 0
 	dst_env->env_tf.tf_regs.reg_eax = 0;
-	dst_env->env_status = ENV_RUNNABLE;
+	sched_enqueue(dst_env);
 	return 0;
 
 }
 
+// Like sys_ipc_try_send, but if envid is not blocked in sys_ipc_recv,
+// block on its queue of senders instead of failing: the send completes
+// when envid next calls sys_ipc_recv, which wakes us with the result.
+// Senders are served in the order they blocked.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send, except -E_IPC_NOT_RECV, and:
+//	-E_INVAL if envid is the calling environment.
+//	-E_BAD_ENV if envid is destroyed while we wait.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *dst_env;
+	int r;
+
+	if ((r = sys_ipc_try_send(envid, value, srcva, perm)) != -E_IPC_NOT_RECV)
+		return r;
+	if (envid2env(envid, &dst_env, 0) < 0)
+		return -E_BAD_ENV;
+	if (dst_env == curenv)
+		return -E_INVAL;
+
+	curenv->env_ipc_send_value = value;
+	curenv->env_ipc_send_srcva = srcva;
+	curenv->env_ipc_send_perm = perm;
+	curenv->env_ipc_send_npages = 0;
+	ipc_block_sender(dst_env);
+}
+
+// Like sys_ipc_send, but send the 'npages' pages at the addresses in
+// the array 'srcvas', all with permissions 'perm'.  The receiver gets
+// as many of them as it asked for in sys_ipc_recv, mapped in order at
+// consecutive addresses from its dstva, and the count in env_ipc_npages.
+// The pages are the ones mapped when we call; a blocked send holds
+// them until it completes.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of sys_ipc_send,
+// and:
+//	-E_INVAL if npages is 0 or more than IPC_MAXPAGES.
+//	-E_INVAL if any of the addresses is not below UTOP.
+static int
+sys_ipc_sendv(envid_t envid, uint32_t value, void **srcvas, size_t npages,
+	      unsigned perm)
+{
+	struct PageInfo *pages[IPC_MAXPAGES];
+	struct Env *dst_env;
+	size_t i;
+	int r;
+
+	if (envid2env(envid, &dst_env, 0) < 0)
+		return -E_BAD_ENV;
+	if (dst_env == curenv)
+		return -E_INVAL;
+	if ((r = ipc_pin(srcvas, npages, perm, pages)) < 0)
+		return r;
+
+	if (dst_env->env_ipc_recving == 1) {
+		r = ipc_deliver_pages(curenv, dst_env, value, pages, npages, perm);
+		for (i = 0; i < npages; i++)
+			page_decref(pages[i]);
+		if (r == 0) {
+			dst_env->env_tf.tf_regs.reg_eax = 0;
+			sched_enqueue(dst_env);
+		}
+		return r;
+	}
+
+	curenv->env_ipc_send_value = value;
+	curenv->env_ipc_send_srcva = (void *) UTOP;
+	curenv->env_ipc_send_perm = perm;
+	memcpy(curenv->env_ipc_send_pages, pages, npages * sizeof(pages[0]));
+	curenv->env_ipc_send_npages = npages;
+	ipc_block_sender(dst_env);
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
+// A sys_ipc_sendv may map up to 'npages' pages from there on; 0 means 1.
+//
+// If senders are blocked in sys_ipc_send, the first one's value is
+// received at once instead, and that sender woken.
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP but npages is more than IPC_MAXPAGES or
+//		the pages would reach UTOP.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, size_t npages)
 {
 	// LAB 4: Your code here.
+	struct Env *sender;
+	int r;
+
+	if (npages == 0)
+		npages = 1;
 	if ((uint32_t)dstva < UTOP && dstva != ROUNDDOWN(dstva,PGSIZE)) return -E_INVAL;
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	if ((uint32_t)dstva < UTOP && (npages > IPC_MAXPAGES
+				      || npages > (UTOP - (uint32_t)dstva) / PGSIZE))
+		return -E_INVAL;
 	curenv->env_ipc_recving = 1;
 	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_npages = npages;
+	while ((sender = curenv->env_ipc_senders)) {
+		curenv->env_ipc_senders = sender->env_ipc_send_link;
+		sender->env_ipc_send_to = NULL;
+		if (sender->env_ipc_send_npages) {
+			r = ipc_deliver_pages(sender, curenv,
+					      sender->env_ipc_send_value,
+					      sender->env_ipc_send_pages,
+					      sender->env_ipc_send_npages,
+					      sender->env_ipc_send_perm);
+			env_ipc_send_release(sender);
+		} else
+			r = ipc_deliver(sender, curenv, sender->env_ipc_send_value,
+					sender->env_ipc_send_srcva,
+					sender->env_ipc_send_perm);
+		sender->env_tf.tf_regs.reg_eax = r;
+		sched_enqueue(sender);
+		if (r == 0)
+			return 0;
+	}
+	curenv->env_status = ENV_NOT_RUNNABLE;
 	sys_yield();
 	panic("Error in sys_ipc_recv: should never get here\n");
+}
 
+// Block until another env rings our doorbell with sys_doorbell_ring,
+// or return at once if it was rung since the last sys_doorbell_wait.
+// Used by lib/ring.c to sleep on an empty or full ring.
+// Returns 0.
+static int
+sys_doorbell_wait(void)
+{
+	if (curenv->env_doorbell) {
+		curenv->env_doorbell = 0;
 		return 0;
 	}
+	curenv->env_doorbell_waiting = 1;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
+// A ring registered with sys_ring_register: the physical page it lives
+// in and the two envs at its ends, which may ring each other's doorbell
+// through it and no one else's.
+struct Channel {
+	struct PageInfo *ch_page;
+	envid_t ch_env[2];
+};
+
+#define NCHANNELS	64
+static struct Channel channels[NCHANNELS];
+
+// Find the channel of the ring at 'va' in curenv that curenv is an end
+// of.  Returns the channel and stores its other end's index in
+// *peer_store, or returns NULL.
+static struct Channel *
+channel_lookup(void *va, int *peer_store)
+{
+	struct PageInfo *pp;
+	int i;
+
+	if ((uintptr_t) va >= UTOP
+	    || !(pp = page_lookup(curenv->env_pgdir, va, 0)))
+		return NULL;
+	for (i = 0; i < NCHANNELS; i++) {
+		if (channels[i].ch_page != pp)
+			continue;
+		if (channels[i].ch_env[0] == curenv->env_id) {
+			*peer_store = 1;
+			return &channels[i];
+		}
+		if (channels[i].ch_env[1] == curenv->env_id) {
+			*peer_store = 0;
+			return &channels[i];
+		}
+	}
+	return NULL;
+}
+
+// Register the ring in the page at 'va', which curenv maps, as a channel
+// between curenv and env 'envid', which must be curenv or its child (as
+// for sys_page_map).  Registering a ring curenv is already an end of
+// replaces its channel.  Slots of channels with an end that no longer
+// exists are reused.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not page-aligned or not mapped.
+//	-E_NO_MEM if all NCHANNELS channels are in use.
+static int
+sys_ring_register(void *va, envid_t envid)
+{
+	struct Channel *ch, *slot = NULL;
+	struct PageInfo *pp;
+	struct Env *e, *peer;
+	int i;
+
+	if (envid2env(envid, &peer, 1) < 0)
+		return -E_BAD_ENV;
+	if ((uintptr_t) va >= UTOP || PGOFF(va)
+	    || !(pp = page_lookup(curenv->env_pgdir, va, 0)))
+		return -E_INVAL;
+
+	for (i = 0; i < NCHANNELS; i++) {
+		ch = &channels[i];
+		if (ch->ch_page == pp && (ch->ch_env[0] == curenv->env_id
+					  || ch->ch_env[1] == curenv->env_id)) {
+			slot = ch;
+			break;
+		}
+		if (!slot && (!ch->ch_page
+			      || envid2env(ch->ch_env[0], &e, 0) < 0
+			      || envid2env(ch->ch_env[1], &e, 0) < 0))
+			slot = ch;
+	}
+	if (!slot)
+		return -E_NO_MEM;
+	slot->ch_page = pp;
+	slot->ch_env[0] = curenv->env_id;
+	slot->ch_env[1] = peer->env_id;
+	return 0;
+}
+
+// Ring the doorbell of the other end of the ring at 'va' (see
+// sys_ring_register): wake it if it is blocked in sys_doorbell_wait, or
+// else make its next sys_doorbell_wait return at once.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if no ring at va has curenv as an end.
+//	-E_BAD_ENV if the other end doesn't exist anymore.
+static int
+sys_doorbell_ring(void *va)
+{
+	struct Channel *ch;
+	struct Env *e;
+	int peer;
+
+	if (!(ch = channel_lookup(va, &peer)))
+		return -E_INVAL;
+	if (envid2env(ch->ch_env[peer], &e, 0) < 0)
+		return -E_BAD_ENV;
+	if (e->env_doorbell_waiting) {
+		e->env_doorbell_waiting = 0;
+		sched_enqueue(e);
+	} else
+		e->env_doorbell = 1;
+	return 0;
+}
 
 static int
 sys_env_set_upcall(envid_t envid, uint32_t trapno, void *func)
@@ -417,6 +1029,18 @@ sys_time_msec(void)
         return time_msec();
 }
 
+// Block until time_msec() reaches 'deadline', without using the CPU.
+// Returns 0 once the deadline has passed (at once if it already has).
+static int
+sys_sleep_until(uint32_t deadline)
+{
+	if (time_msec() >= deadline)
+		return 0;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_sleep(curenv, deadline);
+	sched_yield();
+}
+
 
 /**
 * Make sure the elf is valid before using this syscall
@@ -424,10 +1048,8 @@ sys_time_msec(void)
 static void inner_exec(struct Proghdr * ph,struct Proghdr *eph,void* code){
 	for (; ph < eph; ph++) {
 		if(ph->p_type == ELF_PROG_LOAD) {
-			region_alloc(curenv, (void *) ph->p_va, ph->p_memsz);
-
-			memset((void *) ph->p_va, 0, ph->p_memsz);
-			memcpy((void *) ph->p_va, code + ph->p_offset, ph->p_filesz);
+			region_load(curenv, (void *) ph->p_va, ph->p_memsz,
+				    code + ph->p_offset, ph->p_filesz);
 		}
 	}
 }
@@ -483,14 +1105,15 @@ static int
 sys_send_packet(void *srcva, size_t len)
 {
 		physaddr_t paddr;
-    if (user_mem_check(curenv, srcva, len, PTE_U) < 0)
-        return -E_INVAL;
 int r;
-		r = user_mem_phy_addr(curenv,(uintptr_t) srcva, &paddr);
-		if (r < 0)
-			return r;
-		else
-    	return E1000_transmit((void *)paddr, len);
+		// Keep our parent from unmapping the buffer while we look it up.
+		env_lock(curenv);
+    if (user_mem_check(curenv, srcva, len, PTE_U) < 0)
+        r = -E_INVAL;
+		else if ((r = user_mem_phy_addr(curenv,(uintptr_t) srcva, &paddr)) == 0)
+    	r = E1000_transmit((void *)paddr, len);
+		env_unlock(curenv);
+		return r;
 }
 static uint32_t
 get_mac_addr_from_pkt(void * data){
@@ -558,8 +1181,11 @@ static void add_mac_addr_to_blacklist(uint32_t mac_addr,bool from_user){
 	}
 }
 
+// Receive a packet into dstva and its length into *len_store.  If the
+// receive ring is empty, return -E_RXD_EMPTY at once unless 'block',
+// in which case sleep until the e1000 receives a packet.
 static int
-sys_recv_packet(void *dstva, uint16_t *len_store)
+sys_recv_packet(void *dstva, uint16_t *len_store, bool block)
 {
     if (user_mem_check(curenv, dstva, E1000_ETH_PACKET_LEN, PTE_U|PTE_W) < 0)
         return -E_INVAL;
@@ -592,6 +1218,8 @@ sys_recv_packet(void *dstva, uint16_t *len_store)
 
 			return 0;
 		}
+		if (!block)
+			return r;
 		curenv->env_status = ENV_NOT_RUNNABLE;
 		curenv->e1000_waiting = true;
 		curenv->env_tf.tf_regs.reg_eax = -E_RXD_EMPTY;
@@ -675,9 +1303,13 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_env_set_upcall:
 		{ return sys_env_set_upcall((envid_t) a1,(uint32_t) a2,(void*)a3); }
 		case SYS_ipc_recv:
-		{ return sys_ipc_recv((void*) a1);}
+		{ return sys_ipc_recv((void*) a1, (size_t) a2);}
 		case SYS_ipc_try_send:
 		{ return sys_ipc_try_send((envid_t) a1, (uint32_t)a2,(void*) a3, (unsigned)a4);}
+		case SYS_ipc_send:
+		{ return sys_ipc_send((envid_t) a1, (uint32_t)a2,(void*) a3, (unsigned)a4);}
+		case SYS_ipc_sendv:
+		{ return sys_ipc_sendv((envid_t) a1, (uint32_t) a2, (void **) a3, (size_t) a4, (unsigned) a5);}
 		case SYS_env_set_trapframe:
 		{ return sys_env_set_trapframe((envid_t) a1,(struct Trapframe *)a2);  }
 		case SYS_exec:
@@ -687,7 +1319,7 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_send_packet:
 						return sys_send_packet((void *) a1, (size_t) a2);
 		case SYS_recv_packet:
-						return sys_recv_packet((void *) a1, (uint16_t *) a2);
+						return sys_recv_packet((void *) a1, (uint16_t *) a2, (bool) a3);
 		case SYS_get_macaddr:
         {sys_get_macaddr((uint64_t *) a1);
             return 0;}
@@ -709,8 +1341,75 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		}
 		case SYS_report_bad_packet:
 			return sys_report_bad_packet((char*) a1, (bool) a2);
+		case SYS_env_set_priority:
+			return sys_env_set_priority((envid_t) a1, (int) a2, (uint32_t) a3);
+		case SYS_sleep_until:
+			return sys_sleep_until(a1);
+		case SYS_page_batch:
+			return sys_page_batch((const struct PageOp *) a1, (int) a2);
+		case SYS_fork:
+			return sys_fork();
+		case SYS_page_alloc_large:
+			return sys_page_alloc_large((envid_t) a1, (void *) a2, (int) a3);
+		case SYS_doorbell_wait:
+			return sys_doorbell_wait();
+		case SYS_doorbell_ring:
+			return sys_doorbell_ring((void *) a1);
+		case SYS_ring_register:
+			return sys_ring_register((void *) a1, (envid_t) a2);
 
 	default:
 		return -E_INVAL;
 	}
 }
+
+// Try to handle the system call in 'tf' without the big kernel lock.
+// Only system calls whose state is covered by finer-grained locks (the
+// page allocator, per-env and e1000 locks) are handled here, so that
+// envs on different CPUs can make them in parallel.
+//
+// Returns true, with the result stored in tf's %eax, if the system call
+// was handled.  Returns false, having changed nothing, if the caller
+// must take the big kernel lock and dispatch it with syscall().
+bool
+syscall_nolock(struct Trapframe *tf)
+{
+	struct PushRegs *regs = &tf->tf_regs;
+	// sysenter uses %esi for the return address, not an argument.
+	uint32_t a5 = tf->tf_trapno == T_SYSENTER ? 0 : regs->reg_esi;
+	int32_t r;
+
+	// Zombies are freed on the locked path.
+	if (curenv->env_status != ENV_RUNNING)
+		return false;
+
+	switch (regs->reg_eax) {
+	case SYS_getenvid:
+		r = sys_getenvid();
+		break;
+	case SYS_time_msec:
+		r = sys_time_msec();
+		break;
+	case SYS_page_alloc:
+		r = sys_page_alloc((envid_t) regs->reg_edx, (void *) regs->reg_ecx,
+				   (int) regs->reg_ebx);
+		break;
+	case SYS_page_map:
+		r = sys_page_map((envid_t) regs->reg_edx, (void *) regs->reg_ecx,
+				 (envid_t) regs->reg_ebx, (void *) regs->reg_edi,
+				 (int) a5);
+		break;
+	case SYS_page_unmap:
+		r = sys_page_unmap((envid_t) regs->reg_edx, (void *) regs->reg_ecx);
+		break;
+	case SYS_send_packet:
+		r = sys_send_packet((void *) regs->reg_edx, (size_t) regs->reg_ecx);
+		break;
+	default:
+		return false;
+	}
+	if (r == -E_KERNEL_LOCK)
+		return false;
+	regs->reg_eax = r;
+	return true;
+}
@@ -1,26 +1,58 @@
 #include <kern/time.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
-static unsigned int ticks;
+// Time is kept by the TSC, calibrated once at boot against the PIT, so
+// it does not depend on timer interrupts arriving.
+uint32_t tsc_per_ms;
+static uint64_t tsc_boot;
 
-void
-time_init(void)
+// The PIT's channel 2 can be started and polled without interrupts.
+#define PIT_HZ		1193182
+#define PIT_CH2		0x42
+#define PIT_MODE	0x43
+#define PIT_GATE	0x61		// Channel 2 gate and output
+#define CALIBRATE_MS	10
+
+// Count TSC cycles while PIT channel 2 counts down CALIBRATE_MS.
+static void
+time_calibrate(void)
 {
-	ticks = 0;
+	uint32_t latch = PIT_HZ * CALIBRATE_MS / 1000;
+	uint64_t start, end;
+
+	// Raise the gate, keep the speaker off, and load a mode 0
+	// (interrupt on terminal count) countdown.
+	outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+	outb(PIT_MODE, 0xB0);
+	outb(PIT_CH2, latch & 0xFF);
+	outb(PIT_CH2, latch >> 8);
+
+	start = read_tsc();
+	while (!(inb(PIT_GATE) & 0x20))
+		/* wait for OUT2 to go high */;
+	end = read_tsc();
+
+	tsc_per_ms = (end - start) / CALIBRATE_MS;
+	if (tsc_per_ms == 0)
+		panic("time_calibrate: TSC is not running");
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
 void
-time_tick(void)
+time_init(void)
 {
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	time_calibrate();
+	tsc_boot = read_tsc();
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return (read_tsc() - tsc_boot) / tsc_per_ms;
+}
+
+uint64_t
+time_usec(void)
+{
+	return (read_tsc() - tsc_boot) * 1000 / tsc_per_ms;
 }
@@ -4,8 +4,12 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+extern uint32_t tsc_per_ms;	// TSC cycles per millisecond
+
 void time_init(void);
-void time_tick(void);
 unsigned int time_msec(void);
+uint64_t time_usec(void);
 
 #endif /* JOS_KERN_TIME_H */
@@ -20,6 +20,12 @@
 #define RING3_DPL 3
 #define NTRAPS 49
 extern uint32_t trap_handlers[];
+extern void sysenter_handler(void);
+
+// Model-specific registers that tell sysenter where to enter the kernel.
+#define MSR_SYSENTER_CS		0x174
+#define MSR_SYSENTER_ESP	0x175
+#define MSR_SYSENTER_EIP	0x176
 static struct Taskstate ts;
 
 /* For debugging, so print_trapframe can distinguish between printing
@@ -86,7 +92,7 @@ trap_init(void)
 
 	int i;
 	SETGATE(idt[T_BRKPT], 0, GD_KT, trap_handlers[T_BRKPT], RING3_DPL);
-	for(i = 0; i < 49; i++)
+	for(i = 0; i <= T_WAKEUP; i++)
 	{
 		if (i == T_BRKPT){
 				SETGATE(idt[T_BRKPT], 0, GD_KT, trap_handlers[T_BRKPT], RING3_DPL);
@@ -155,6 +161,11 @@ trap_init_percpu(void)
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+	// sysenter enters at sysenter_handler on this CPU's kernel stack.
+	wrmsr(MSR_SYSENTER_CS, GD_KT);
+	wrmsr(MSR_SYSENTER_ESP, thiscpu->cpu_ts.ts_esp0);
+	wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_handler);
 }
 
 void
@@ -210,7 +221,7 @@ trap_dispatch(struct Trapframe *tf)
 	// LAB 3: Your code here.
 	//int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
 	switch(tf->tf_trapno){
-		case T_PGFLT: { page_fault_handler(tf); break; }
+		case T_PGFLT: { page_fault_handler(tf); return; }
 		case T_BRKPT: { monitor(tf); break; }
 		case T_SYSCALL: {
 											int32_t res = syscall((tf->tf_regs).reg_eax,
@@ -221,6 +232,17 @@ trap_dispatch(struct Trapframe *tf)
 											(tf->tf_regs).reg_esi);
 											(tf->tf_regs).reg_eax = res;
 											return; }
+		case T_SYSENTER: {
+											// %esi holds the return %eip, so
+											// there is no fifth argument.
+											int32_t res = syscall((tf->tf_regs).reg_eax,
+											(tf->tf_regs).reg_edx,
+											(tf->tf_regs).reg_ecx,
+											(tf->tf_regs).reg_ebx,
+											(tf->tf_regs).reg_edi,
+											0);
+											(tf->tf_regs).reg_eax = res;
+											return; }
 		default: break;
 	}
 
@@ -237,13 +259,18 @@ trap_dispatch(struct Trapframe *tf)
 	// interrupt using lapic_eoi() before calling the scheduler!
 	// LAB 4: Your code here.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER){
-		if (cpunum() == 0)
-							time_tick();
 		lapic_eoi();
-		sched_yield();
-		panic("Error trap: return after clock\n");
+		sched_tick();
+		return;
 	}//until here goodman
 
+	// Another CPU queued work for us while we were halted.  trap()
+	// goes on to the scheduler since curenv is NULL.
+	if (tf->tf_trapno == T_WAKEUP) {
+		lapic_eoi();
+		return;
+	}
+
 	// Add time tick increment to clock interrupts.
 	// Be careful! In multiprocessors, clock interrupts are
 	// triggered on every CPU.
@@ -313,6 +340,16 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// sysenter doesn't clear EFLAGS.TF, so a user who sets it before a
+	// system call gets a single-step trap in the kernel, on the first
+	// instruction of sysenter_handler.  Resume the handler without TF;
+	// it masks TF out of the env's saved eflags.
+	if (tf->tf_trapno == T_DEBUG && (tf->tf_cs & 3) == 0
+	    && tf->tf_eip == (uintptr_t) sysenter_handler) {
+		tf->tf_eflags &= ~FL_TF;
+		env_pop_tf(tf);
+	}
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
@@ -328,6 +365,15 @@ trap(struct Trapframe *tf)
 		// serious kernel work.
 		// LAB 4: Your code here.
 		assert(curenv);
+
+		// System calls covered by finer-grained locks run without
+		// the big kernel lock, so they can proceed in parallel on
+		// different CPUs.  Nothing else happened on this trap, so
+		// return straight to the environment.
+		if ((tf->tf_trapno == T_SYSCALL || tf->tf_trapno == T_SYSENTER) &&
+		    syscall_nolock(tf))
+			env_pop_tf(tf);
+
 		lock_kernel();
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
@@ -351,12 +397,23 @@ trap(struct Trapframe *tf)
 	// Dispatch based on what type of trap occurred
 	trap_dispatch(tf);
 
+	// A kernel-mode fault that got this far was resolved (see
+	// page_fault_handler); resume the kernel where it faulted.
+	if ((tf->tf_cs & 3) == 0 && tf->tf_trapno == T_PGFLT)
+		env_pop_tf(tf);
+
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
-	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNING)
-		env_run(curenv);
-	else
+	// if doing so makes sense.  It never left this CPU, so its
+	// page directory is still loaded and none of env_run's context
+	// switch work is needed.  Nor is its cr3 reload: whatever changed
+	// the env's live mappings flushed their TLB entries itself
+	// (page_insert, page_remove and page_cow_fault call tlb_invalidate;
+	// pgdir_unshare and sys_fork flush the whole TLB).
+	if (curenv && curenv->env_status == ENV_RUNNING) {
+		unlock_kernel();
+		env_pop_tf(&curenv->env_tf);
+	} else
 		sched_yield();
 }
 
@@ -374,11 +431,28 @@ page_fault_handler(struct Trapframe *tf)
 	// LAB 3: Your code here.
 	fault_va = rcr2();
 	if(!(tf->tf_cs & 3)){
+		// The kernel may touch the env's reserved or copy-on-write
+		// memory on its behalf; fix it up as for the env itself.
+		if (curenv && fault_va < UTOP && !(tf->tf_err & FEC_PR) &&
+		    page_lazy_fault(curenv->env_pgdir, (void *) fault_va) == 0)
+			return;
+		if (curenv && fault_va < UTOP && (tf->tf_err & FEC_WR) &&
+		    page_cow_fault(curenv->env_pgdir, (void *) fault_va) == 0)
+			return;
 		panic("Error in page_fault_handler: Kernel Page Fault\n");
 	}
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// First touches of reserved pages and copy-on-write faults are
+	// resolved here, without an upcall.
+	if (!(tf->tf_err & FEC_PR) &&
+	    page_lazy_fault(curenv->env_pgdir, (void *) fault_va) == 0)
+		return;
+	if ((tf->tf_err & FEC_WR) &&
+	    page_cow_fault(curenv->env_pgdir, (void *) fault_va) == 0)
+		return;
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -6,14 +6,19 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
-// Send an inter-environment request to the file server, and wait for
-// a reply.  The request body should be in fsipcbuf, and parts of the
-// response may be written back to fsipcbuf.
-// type: request code, passed as the simple integer IPC value.
-// dstva: virtual address at which to receive reply page, 0 if none.
+// Like fsipc, but for requests and replies that carry several pages.
+// srcpgs: if non-null, the 'nsrc' pages to send, read-only, in one
+// vectored IPC; the first must be &fsipcbuf.  If null, fsipcbuf is
+// sent alone, writable, so the server can reply in it.
+// dstva: virtual address at which to receive reply pages, 0 if none.
+// ndst: if non-null, the number of reply pages to accept from dstva
+// on, and set to the number received.  Otherwise one is accepted.
+// perm_store: if non-null, set to the reply pages' permissions, or 0
+// if the file server sent none.
 // Returns result from the file server.
 static int
-fsipc(unsigned type, void *dstva)
+fsipcv(unsigned type, void **srcpgs, size_t nsrc, void *dstva,
+       size_t *ndst, int *perm_store)
 {
 	static envid_t fsenv;
 	if (fsenv == 0)
@@ -24,8 +29,23 @@ fsipc(unsigned type, void *dstva)
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	if (srcpgs)
+		ipc_sendv(fsenv, type, srcpgs, nsrc, PTE_P | PTE_U);
+	else
+		ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
+	return ipc_recvv(NULL, dstva, ndst ? *ndst : 1, perm_store, ndst);
+}
+
+// Send an inter-environment request to the file server, and wait for
+// a reply.  The request body should be in fsipcbuf, and parts of the
+// response may be written back to fsipcbuf.
+// type: request code, passed as the simple integer IPC value.
+// dstva: virtual address at which to receive reply page, 0 if none.
+// Returns result from the file server.
+static int
+fsipc(unsigned type, void *dstva)
+{
+	return fsipcv(type, NULL, 0, dstva, NULL, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -103,6 +123,31 @@ devfile_flush(struct Fd *fd)
 	return fsipc(FSREQ_FLUSH, NULL);
 }
 
+// Returns how many of the first 'npages' pages at page-aligned 'va'
+// are private and writable -- present with PTE_W or PTE_COW, or
+// reserved writable with PTE_LAZY, and not PTE_SHARE -- so that
+// mapping another page over them is indistinguishable from writing
+// to them.  Pages of a 4MB mapping don't qualify.
+static size_t
+replaceable_pages(void *va, size_t npages)
+{
+	uintptr_t a = (uintptr_t) va;
+	size_t i;
+	pte_t pte;
+
+	for (i = 0; i < npages; i++, a += PGSIZE) {
+		if (!(uvpd[PDX(a)] & PTE_P) || (uvpd[PDX(a)] & PTE_PS))
+			break;
+		pte = uvpt[PGNUM(a)];
+		if (!(pte & PTE_U) || (pte & PTE_SHARE))
+			break;
+		if (!((pte & PTE_P) && (pte & (PTE_W|PTE_COW)))
+		    && !((pte & PTE_LAZY) && (pte & PTE_W)))
+			break;
+	}
+	return i;
+}
+
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
 //
 // Returns:
@@ -115,11 +160,30 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// filling fsipcbuf.read with the request arguments.  The
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
+	size_t npages;
 	int r;
 
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
-	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+
+	// Whole blocks read into a page-aligned buffer take no copies: ask
+	// for the file server's block cache pages themselves, up to
+	// IPC_MAXPAGES of them in one round trip, mapped copy-on-write over
+	// the buffer's pages.  The server falls back to an ordinary read,
+	// and sends no pages, when it can't do that.
+	// Only private, writable buffer pages may be replaced that way:
+	// mapping over a PTE_SHARE page would unshare it, and a read-only
+	// buffer must fault as it would under the copy below.
+	if (PGOFF(buf) == 0 && n >= BLKSIZE && fd->fd_offset % BLKSIZE == 0
+	    && (npages = replaceable_pages(buf, MIN(n / PGSIZE, IPC_MAXPAGES))) > 0) {
+		fsipcbuf.read.req_n = npages * BLKSIZE;
+		if ((r = fsipcv(FSREQ_READ_MAP, NULL, 0, buf, &npages, NULL)) < 0)
+			return r;
+		if (npages > 0) {
+			assert(r == npages * BLKSIZE);
+			return r;
+		}
+	} else if ((r = fsipc(FSREQ_READ, NULL)) < 0)
 		return r;
 	assert(r <= n);
 	assert(r <= PGSIZE);
@@ -128,6 +192,27 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 }
 
 
+// Returns how many of the first 'npages' pages at page-aligned 'va' can
+// be sent over IPC as they are: present, or reserved with PTE_LAZY,
+// which the kernel allocates when sending.  Pages that only a user
+// fault handler fills in, such as untouched mmap pages, aren't.
+static size_t
+sendable_pages(const void *va, size_t npages)
+{
+	uintptr_t a = (uintptr_t) va;
+	size_t i;
+	pte_t pte;
+
+	for (i = 0; i < npages; i++, a += PGSIZE) {
+		if (!(uvpd[PDX(a)] & PTE_P))
+			break;
+		pte = uvpte(PGNUM(a));
+		if (!(pte & PTE_U) || !(pte & (PTE_P|PTE_LAZY)))
+			break;
+	}
+	return i;
+}
+
 // Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
 //
 // Returns:
@@ -143,6 +228,29 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// LAB 5: Your code here
 	int r;
 	uint32_t buf_size = PGSIZE - (sizeof(int) + sizeof(size_t));
+	void *pgs[IPC_MAXPAGES];
+	size_t i, npages;
+
+	// Larger writes send the pages of 'buf' themselves, up to
+	// IPC_MAXPAGES - 1 of them, after the request page in one vectored
+	// IPC, rather than copying a page's worth into fsipcbuf at a time.
+	// The kernel refuses pages that aren't there, so stop short of
+	// the first one; if that's the first page, the copy below faults
+	// it in.
+	if (n > buf_size
+	    && (npages = sendable_pages(ROUNDDOWN(buf, PGSIZE),
+			MIN(ROUNDUP(PGOFF(buf) + n, PGSIZE) / PGSIZE,
+			    IPC_MAXPAGES - 1))) > 0) {
+		n = MIN(n, npages * PGSIZE - PGOFF(buf));
+		fsipcbuf.writev.req_fileid = fd->fd_file.id;
+		fsipcbuf.writev.req_n = n;
+		fsipcbuf.writev.req_pgoff = PGOFF(buf);
+		pgs[0] = &fsipcbuf;
+		for (i = 0; i < npages; i++)
+			pgs[i + 1] = ROUNDDOWN((char *) buf, PGSIZE) + i * PGSIZE;
+		return fsipcv(FSREQ_WRITEV, pgs, npages + 1, NULL, NULL, NULL);
+	}
+
 	if (n>buf_size) n = buf_size;
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = n;
@@ -192,6 +300,16 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 }
 
 
+// Delete a file
+int
+remove(const char *path)
+{
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.remove.req_path, path);
+	return fsipc(FSREQ_REMOVE, NULL);
+}
+
 // Synchronize disk with buffer cache
 int
 sync(void)
@@ -201,3 +319,44 @@ sync(void)
 
 	return fsipc(FSREQ_SYNC, NULL);
 }
+
+// Fetch the file server's block cache statistics into 'st'.
+int
+fs_cache_stat(struct Fsret_cache_stat *st)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_CACHE_STAT, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.cacheStatRet;
+	return 0;
+}
+
+// Map the block of open file 'fdnum' at 'offset', which must be
+// block-aligned and within the file, at 'dstva' with permissions 'perm'
+// (PTE_P|PTE_U, optionally PTE_W).  The page is the file server's block
+// cache page: read-only, or copy-on-write if 'perm' has PTE_W, so it is
+// shared with every other process that maps the block.  The seek
+// position doesn't change.
+// Page fault handlers call this (see mmap.c), perhaps while fsipcbuf is
+// half filled in for another request, so fsipcbuf is left as it was.
+int
+file_map(int fdnum, off_t offset, void *dstva, int perm)
+{
+	struct Fsreq_map saved;
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+
+	saved = fsipcbuf.map;
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	fsipcbuf.map.req_perm = perm;
+	r = fsipc(FSREQ_MAP, dstva);
+	fsipcbuf.map = saved;
+	return r;
+}
@@ -3,10 +3,6 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -66,17 +62,21 @@ duppage(envid_t envid, unsigned pn)
 	int r;
 
 	// LAB 4: Your code here.
+	// The mappings are only queued here; fork() flushes them in batches.
 	void * addr = (void *) (pn * PGSIZE);
-	if (uvpt[pn] & PTE_SHARE){
-		sys_page_map(0, addr, envid, addr,(uvpt[pn] & PTE_SYSCALL));
+	pte_t pte = uvpte(pn);
+	if (pte & PTE_SHARE){
+		r = page_batch_map(0, addr, envid, addr,(pte & PTE_SYSCALL));
+		if(r<0) return r;
 	}
-	else if((uvpt[pn] & PTE_W) || (uvpt[pn] & PTE_COW) ) {
-		r = sys_page_map(0, addr, envid, addr, ((uvpt[pn] & PTE_SYSCALL) & ~PTE_W) | PTE_COW); //TODO: MAYBE BUG HERE
-		if(r<0) return -1;
-		r = sys_page_map(0, addr, 0, addr, ((uvpt[pn] & PTE_SYSCALL) & ~PTE_W) | PTE_COW);
-		if(r<0) return -1;
+	else if((pte & PTE_W) || (pte & PTE_COW) ) {
+		r = page_batch_map(0, addr, envid, addr, ((pte & PTE_SYSCALL) & ~PTE_W) | PTE_COW); //TODO: MAYBE BUG HERE
+		if(r<0) return r;
+		r = page_batch_map(0, addr, 0, addr, ((pte & PTE_SYSCALL) & ~PTE_W) | PTE_COW);
+		if(r<0) return r;
 	} else {
-		sys_page_map(0, addr, envid, addr, uvpt[pn] & PTE_SYSCALL);
+		r = page_batch_map(0, addr, envid, addr, pte & PTE_SYSCALL);
+		if(r<0) return r;
 	}
 	return 0;
 }
@@ -98,7 +98,7 @@ duppage(envid_t envid, unsigned pn)
 //   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
-fork(void)
+ufork(void)
 {
 	// LAB 4: Your code here.
 	set_pgfault_handler(pgfault);
@@ -114,16 +114,29 @@ fork(void)
 	}
 
 	uint32_t addr;
+	int res;
 	for(addr = 0; addr < USTACKTOP; addr += PGSIZE){
-			if((uvpd[PDX(addr)] & PTE_P) &&
-			 (uvpt[PGNUM(addr)] & PTE_P) &&
-			  (uvpt[PGNUM(addr)] & PTE_U))
+			// Skip whole page tables that aren't there.
+			if(!(uvpd[PDX(addr)] & PTE_P)) {
+				addr = ROUNDDOWN(addr, PTSIZE) + PTSIZE - PGSIZE;
+				continue;
+			}
+			if((uvpte(PGNUM(addr)) & PTE_P) &&
+			  (uvpte(PGNUM(addr)) & PTE_U))
+				{
+					if((res = duppage(id, PGNUM(addr))) < 0)
+						panic("Error in fork: duppage: %e\n", res);
+				}
+			// A page not touched yet is just reserved in the child too.
+			else if(uvpte(PGNUM(addr)) & PTE_LAZY)
 				{
-					duppage(id, PGNUM(addr));
+					if((res = page_batch_alloc(id, (void *) addr, (uvpte(PGNUM(addr)) & PTE_SYSCALL) | PTE_P | PTE_LAZY)) < 0)
+						panic("Error in fork: duppage: %e\n", res);
 				}
 
 	}
-	int res;
+	if((res = page_batch_flush()) < 0)
+		panic("Error in fork: duppage: %e\n", res);
 	if(sys_page_alloc(id, (void *) (UXSTACKTOP - PGSIZE), PTE_U|PTE_P|PTE_W) < 0)
 		panic("could not allocate exception stack");
 
@@ -140,6 +153,24 @@ fork(void)
 
 }
 
+//
+// Copy-on-write fork done by the kernel (see sys_fork).
+// The kernel copies our page tables directly and resolves the child's
+// and our copy-on-write faults itself, so unlike ufork() this needs no
+// page fault handler and makes a single system call.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+fork(void)
+{
+	envid_t id = sys_fork();
+
+	if (id == 0)
+		thisenv = &envs[ENVX(sys_getenvid())];
+	return id;
+}
+
 // Challenge!
 int
 sfork(void)
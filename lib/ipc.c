@@ -41,34 +41,67 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function blocks in the kernel until 'toenv' receives it.
+// It should panic() on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
+//   If 'pg' is null, pass sys_ipc_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
 	// LAB 4: Your code here.
-	//sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	if(!pg){
 		pg = (void*)UTOP;
 	}
-	int res = -E_IPC_NOT_RECV;
-	while (res == -E_IPC_NOT_RECV) {
-		/* code */
-		res = sys_ipc_try_send(to_env,val,pg,perm);
-		if(res < 0 && res != -E_IPC_NOT_RECV){
-			panic("Error in ipc_send: res = %d \n",res);
-		}
-		if(res != 0){
+	// The kernel queues us on to_env until it calls sys_ipc_recv,
+	// rather than having us spin with sys_yield.
+	int res = sys_ipc_send(to_env,val,pg,perm);
+	if(res < 0){
+		panic("Error in ipc_send: res = %d \n",res);
+	}
+}
+
+// Send 'val' and the 'npages' pages at the addresses in 'pgs', all with
+// 'perm', to 'toenv' in one IPC (see sys_ipc_sendv).  Blocks in the
+// kernel until 'toenv' receives it, and panics on any error.
+void
+ipc_sendv(envid_t to_env, uint32_t val, void **pgs, size_t npages, int perm)
+{
+	int r;
 
-			sys_yield();
-		}
+	if ((r = sys_ipc_sendv(to_env, val, pgs, npages, perm)) < 0)
+		panic("ipc_sendv: %e", r);
+}
+
+// Like ipc_recv, but accept up to 'npages' pages, which a sender using
+// ipc_sendv maps at consecutive addresses from 'pg'.
+// If 'npages_store' is nonnull, store the number of pages received in
+// *npages_store (0 on error).
+int32_t
+ipc_recvv(envid_t *from_env_store, void *pg, size_t npages, int *perm_store,
+	  size_t *npages_store)
+{
+	int r;
+
+	if (!pg)
+		pg = (void *) UTOP;
+	if ((r = sys_ipc_recvv(pg, npages)) < 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		if (npages_store)
+			*npages_store = 0;
+		return r;
 	}
-	
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	if (npages_store)
+		*npages_store = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
 }
 
 // Find the first environment of the given type.  We'll use this to
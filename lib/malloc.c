@@ -14,6 +14,8 @@
  * If we need to allocate a large amount (more than a page)
  * we can't put a ref count at the end of each page,
  * so we mark the pte entry with the bit PTE_CONTINUED.
+ * Those pages are only reserved (PTE_LAZY), so a large chunk
+ * only takes memory for the pages the caller touches.
  */
 enum
 {
@@ -33,7 +35,7 @@ isfree(void *v, size_t n)
 
 	for (va = (uintptr_t) v; va < end_va; va += PGSIZE)
 		if (va >= (uintptr_t) mend
-		    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)))
+		    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & (PTE_P|PTE_LAZY))))
 			return 0;
 	return 1;
 }
@@ -96,7 +98,7 @@ malloc(size_t n)
 	 * allocate at mptr - the +4 makes sure we allocate a ref count.
 	 */
 	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
+		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED|PTE_LAZY : 0;
 		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
 			for (; i >= 0; i -= PGSIZE)
 				sys_page_unmap(0, mptr + i);
@@ -0,0 +1,141 @@
+// Memory-mapped files.
+// mmap reserves a range of addresses for part of an open file; the
+// first access to each page faults, and the page fault handler asks the
+// file server for the file's block cache page there (see file_map).
+// Read-only mappings of a file share the cache's pages with every other
+// process mapping it, and writable ones are private and copy-on-write.
+
+#include <inc/lib.h>
+
+#define MMAP_MAX	16
+
+struct Mmap {
+	uintptr_t mm_va;	// first address of the mapping, 0 if unused
+	size_t mm_len;		// bytes mapped, a multiple of PGSIZE
+	int mm_fdnum;		// our own dup of the file's descriptor
+	off_t mm_offset;	// file offset of mm_va
+	int mm_perm;		// PTE_P|PTE_U, maybe PTE_W
+};
+
+static struct Mmap mmaps[MMAP_MAX];
+
+// The page fault handler mmap replaced, which gets faults outside any
+// mapping.
+static void (*mmap_next_handler)(struct UTrapframe *utf);
+
+extern void (*_pgfault_handler)(struct UTrapframe *utf);
+
+// Returns the mapping containing 'va', or NULL.
+static struct Mmap *
+mmap_lookup(uintptr_t va)
+{
+	int i;
+
+	for (i = 0; i < MMAP_MAX; i++)
+		if (mmaps[i].mm_va && va >= mmaps[i].mm_va
+		    && va - mmaps[i].mm_va < mmaps[i].mm_len)
+			return &mmaps[i];
+	return NULL;
+}
+
+static void
+mmap_pgfault(struct UTrapframe *utf)
+{
+	uintptr_t va = ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+	struct Mmap *m;
+	int r;
+
+	// Faults on pages already there (writes to read-only mappings)
+	// aren't ours to fix.
+	if (!(m = mmap_lookup(va))
+	    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P))) {
+		if (mmap_next_handler) {
+			mmap_next_handler(utf);
+			return;
+		}
+		panic("page fault at va %08x, eip %08x, err %04x",
+		      utf->utf_fault_va, utf->utf_eip, utf->utf_err);
+	}
+
+	if ((r = file_map(m->mm_fdnum, m->mm_offset + (va - m->mm_va),
+			  (void *) va, m->mm_perm)) < 0)
+		panic("mmap: fault at va %08x: %e", utf->utf_fault_va, r);
+}
+
+// Map 'len' bytes of open file 'fdnum', starting at 'offset', at 'va'.
+// 'perm' is PTE_P|PTE_U, optionally with PTE_W for a private
+// copy-on-write mapping whose changes never reach the file.  'va' must
+// be page-aligned, 'offset' block-aligned, and the range must be
+// unmapped.  Pages are fetched from the file server when first touched;
+// touching a page past the end of the file panics.  The mapping keeps
+// the file open until munmap, even if 'fdnum' is closed.
+// Returns 0 on success, < 0 on error.
+int
+mmap(void *va, size_t len, int perm, int fdnum, off_t offset)
+{
+	struct Fd *fd, *nfd;
+	struct Mmap *m = NULL;
+	uintptr_t a, start = (uintptr_t) va;
+	int i, r;
+
+	len = ROUNDUP(len, PGSIZE);
+	if (PGOFF(start) || offset < 0 || offset % BLKSIZE != 0 || len == 0
+	    || start + len < start || start + len > USTACKTOP - PGSIZE
+	    || (perm & ~(PTE_P|PTE_U|PTE_W)) != 0)
+		return -E_INVAL;
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+
+	for (a = start; a < start + len; a += PGSIZE)
+		if (mmap_lookup(a) || ((uvpd[PDX(a)] & PTE_P)
+				       && (uvpt[PGNUM(a)] & (PTE_P|PTE_LAZY))))
+			return -E_INVAL;
+	for (i = 0; i < MMAP_MAX && !m; i++)
+		if (!mmaps[i].mm_va)
+			m = &mmaps[i];
+	if (!m)
+		return -E_NO_MEM;
+
+	if ((r = fd_alloc(&nfd)) < 0)
+		return r;
+	if ((r = dup(fdnum, fd2num(nfd))) < 0)
+		return r;
+
+	m->mm_va = start;
+	m->mm_len = len;
+	m->mm_fdnum = r;
+	m->mm_offset = offset;
+	m->mm_perm = perm | PTE_P | PTE_U;
+
+	if (_pgfault_handler != mmap_pgfault) {
+		mmap_next_handler = _pgfault_handler;
+		set_pgfault_handler(mmap_pgfault);
+	}
+	return 0;
+}
+
+// Remove the mapping that starts at 'va', dropping any pages of it
+// that have been touched.
+// Returns 0 on success, -E_INVAL if no mapping starts at 'va'.
+int
+munmap(void *va)
+{
+	struct Mmap *m;
+	uintptr_t a;
+	int r;
+
+	if (!(m = mmap_lookup((uintptr_t) va)) || m->mm_va != (uintptr_t) va)
+		return -E_INVAL;
+
+	for (a = m->mm_va; a < m->mm_va + m->mm_len; a += PGSIZE)
+		if ((uvpd[PDX(a)] & PTE_P) && (uvpt[PGNUM(a)] & PTE_P)
+		    && (r = page_batch_unmap(0, (void *) a)) < 0)
+			return r;
+	if ((r = page_batch_flush()) < 0)
+		return r;
+	close(m->mm_fdnum);
+	m->mm_va = 0;
+	return 0;
+}
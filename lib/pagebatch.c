@@ -0,0 +1,67 @@
+// Queue page-mapping system calls and make them all at once with
+// sys_page_batch, so that fork and spawn pay one kernel entry per
+// batch rather than one or two per page.
+
+#include <inc/lib.h>
+
+#define PAGE_BATCH_MAX	128
+
+static struct PageOp batch[PAGE_BATCH_MAX];
+static int nbatch;
+
+// Make the queued operations, in order.
+// Returns 0 on success, < 0 on the first failing operation's error.
+// The queue is empty afterwards either way.
+int
+page_batch_flush(void)
+{
+	int n = nbatch;
+
+	nbatch = 0;
+	if (n == 0)
+		return 0;
+	return sys_page_batch(batch, n);
+}
+
+// Queue one operation, flushing first if the queue is full.
+static int
+page_batch_add(int op, envid_t envid, void *va, envid_t dstenvid,
+	       void *dstva, int perm)
+{
+	struct PageOp *p;
+	int r;
+
+	if (nbatch == PAGE_BATCH_MAX && (r = page_batch_flush()) < 0)
+		return r;
+	p = &batch[nbatch++];
+	p->op = op;
+	p->envid = envid;
+	p->va = va;
+	p->dstenvid = dstenvid;
+	p->dstva = dstva;
+	p->perm = perm;
+	return 0;
+}
+
+// Queue a sys_page_alloc.
+int
+page_batch_alloc(envid_t envid, void *va, int perm)
+{
+	return page_batch_add(PAGEOP_ALLOC, envid, va, 0, 0, perm);
+}
+
+// Queue a sys_page_map.
+int
+page_batch_map(envid_t srcenvid, void *srcva,
+	       envid_t dstenvid, void *dstva, int perm)
+{
+	return page_batch_add(PAGEOP_MAP, srcenvid, srcva, dstenvid, dstva,
+			      perm);
+}
+
+// Queue a sys_page_unmap.
+int
+page_batch_unmap(envid_t envid, void *va)
+{
+	return page_batch_add(PAGEOP_UNMAP, envid, va, 0, 0, 0);
+}
@@ -0,0 +1,96 @@
+// Shared-memory descriptor rings between two environments.
+// See inc/ring.h.  The peers only enter the kernel to sleep on an
+// empty or full ring, and to wake a peer sleeping on one.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Allocate a ring in a fresh page at 'r', shared with any env it is
+// later mapped into, including children forked after this.
+// Returns 0 on success, < 0 on error.
+int
+ring_alloc(struct Ring *r)
+{
+	return sys_page_alloc(0, r, PTE_P|PTE_U|PTE_W|PTE_SHARE);
+}
+
+// Tell the kernel that the ring at 'r' connects us with 'peer', our
+// child, which already maps it; until then, neither side can wake the
+// other.  One side produces and the other consumes.
+// Returns 0 on success, < 0 on error.
+int
+ring_connect(struct Ring *r, envid_t peer)
+{
+	return sys_ring_register(r, peer);
+}
+
+// Map the ring at 'r' at 'peerva' in env 'peer', our child, and connect
+// us with it through the ring.
+// Returns 0 on success, < 0 on error.
+int
+ring_share(struct Ring *r, envid_t peer, void *peerva)
+{
+	int err;
+
+	if ((err = sys_page_map(0, r, peer, peerva, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		return err;
+	return ring_connect(r, peer);
+}
+
+// Sleep until the other side rings our doorbell, unless 'ready' already
+// holds once *waiting is set.  The other side clears *waiting before it
+// rings, so at most one doorbell is rung per sleep; one rung too late
+// just makes the next sleep return at once.
+static void
+ring_sleep(struct Ring *r, volatile uint32_t *waiting,
+	   bool (*ready)(struct Ring *))
+{
+	xchg(waiting, 1);
+	if (ready(r))
+		xchg(waiting, 0);
+	else
+		sys_doorbell_wait();
+}
+
+static bool
+ring_nonempty(struct Ring *r)
+{
+	return r->r_head != r->r_tail;
+}
+
+static bool
+ring_nonfull(struct Ring *r)
+{
+	return r->r_head - r->r_tail != RING_SIZE;
+}
+
+// Append a copy of 'd' to the ring, sleeping while it is full.
+// Wakes the consumer if it is sleeping on the ring being empty.
+void
+ring_push(struct Ring *r, const struct RingDesc *d)
+{
+	while (!ring_nonfull(r))
+		ring_sleep(r, &r->r_prod_waiting, ring_nonfull);
+	r->r_desc[r->r_head % RING_SIZE] = *d;
+	// The descriptor must be in place before the consumer can see it.
+	// x86 doesn't reorder stores; keep the compiler from doing so.
+	asm volatile("" : : : "memory");
+	r->r_head++;
+	if (xchg(&r->r_cons_waiting, 0))
+		sys_doorbell_ring(r);
+}
+
+// Remove the oldest descriptor from the ring into 'd', sleeping while
+// the ring is empty.  Wakes the producer if it is sleeping on the ring
+// being full.
+void
+ring_pop(struct Ring *r, struct RingDesc *d)
+{
+	while (!ring_nonempty(r))
+		ring_sleep(r, &r->r_cons_waiting, ring_nonempty);
+	*d = r->r_desc[r->r_tail % RING_SIZE];
+	asm volatile("" : : : "memory");
+	r->r_tail++;
+	if (xchg(&r->r_prod_waiting, 0))
+		sys_doorbell_ring(r);
+}
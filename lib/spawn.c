@@ -5,6 +5,9 @@
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Number of temporary pages map_segment loads a segment through at once.
+#define SEG_WINDOW		32
+
 
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
@@ -264,7 +267,7 @@ static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
+	int i, j, n, nmap, r, pgperm;
 	void *blk;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
@@ -276,25 +279,60 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+	// File-backed pages are handled SEG_WINDOW at a time in a window of
+	// temporary pages at UTEMP.  Whole pages of the file come straight
+	// from the file server's block cache with file_map, when the
+	// segment is block-aligned in the file; the rest are read with one
+	// readn per window.
+	for (i = 0; i < filesz; i += n * PGSIZE) {
+		n = MIN(SEG_WINDOW, (ROUNDUP(filesz, PGSIZE) - i) / PGSIZE);
+		nmap = 0;
+		if (fileoffset % BLKSIZE == 0)
+			nmap = MIN(n, (filesz - i) / PGSIZE);
+		for (j = 0; j < nmap; j++)
+			if ((r = file_map(fd, fileoffset + i + j * PGSIZE,
+					  UTEMP + j * PGSIZE, perm)) < 0)
+				goto error;
+		if (nmap < n) {
+			for (j = nmap; j < n; j++)
+				if ((r = page_batch_alloc(0, UTEMP + j * PGSIZE,
+							  PTE_P|PTE_U|PTE_W)) < 0)
+					goto error;
+			if ((r = page_batch_flush()) < 0)
+				goto error;
+			if ((r = seek(fd, fileoffset + i + nmap * PGSIZE)) < 0)
+				goto error;
+			if ((r = readn(fd, UTEMP + nmap * PGSIZE,
+				       MIN((n - nmap) * PGSIZE,
+					   filesz - i - nmap * PGSIZE))) < 0)
+				goto error;
+		}
+		for (j = 0; j < n; j++) {
+			// Block cache pages are copy-on-write here, and the
+			// child gets them the same way.
+			if ((perm & PTE_W) && !(uvpt[PGNUM(UTEMP + j * PGSIZE)] & PTE_W))
+				pgperm = (perm & ~PTE_W) | PTE_COW;
+			else
+				pgperm = perm;
+			if ((r = page_batch_map(0, UTEMP + j * PGSIZE, child,
+						(void*) (va + i + j * PGSIZE), pgperm)) < 0
+			    || (r = page_batch_unmap(0, UTEMP + j * PGSIZE)) < 0)
+				goto error;
 		}
+		if ((r = page_batch_flush()) < 0)
+			goto error;
 	}
-	return 0;
+
+	// The rest are blank pages.
+	for (; i < memsz; i += PGSIZE)
+		if ((r = page_batch_alloc(child, (void*) (va + i), perm)) < 0)
+			return r;
+	return page_batch_flush();
+
+error:
+	for (j = 0; j < n; j++)
+		sys_page_unmap(0, UTEMP + j * PGSIZE);
+	return r;
 }
 
 // Copy the mappings for shared pages into the child address space.
@@ -305,19 +343,19 @@ copy_shared_pages(envid_t child)
 	uint32_t addr;
 	for(addr = 0; addr < USTACKTOP; addr += PGSIZE){
 			if((uvpd[PDX(addr)] & PTE_P) &&
-			  (uvpt[PGNUM(addr)] & PTE_P) &&
-			  (uvpt[PGNUM(addr)] & PTE_U) &&
-			  (uvpt[PGNUM(addr)] & PTE_SHARE))
+			  (uvpte(PGNUM(addr)) & PTE_P) &&
+			  (uvpte(PGNUM(addr)) & PTE_U) &&
+			  (uvpte(PGNUM(addr)) & PTE_SHARE))
 				{
 					//if (uvpt[PGNUM(addr)] & PTE_SHARE){
 						// void * full_addr = (void *) (PGNUM(addr) * PGSIZE);
-						sys_page_map(0, (void*)addr, child, (void*)addr,(uvpt[PGNUM(addr)] & PTE_SYSCALL));
+						page_batch_map(0, (void*)addr, child, (void*)addr,(uvpte(PGNUM(addr)) & PTE_SYSCALL));
 					//}
 				}
 
 	}
 
-	return 0;
+	return page_batch_flush();
 }
 
 
@@ -20,16 +20,41 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// potentially change the condition codes and arbitrary
 	// memory locations.
 
-	asm volatile("int %1\n"
-		: "=a" (ret)
-		: "i" (T_SYSCALL),
-		  "a" (num),
-		  "d" (a1),
-		  "c" (a2),
-		  "b" (a3),
-		  "D" (a4),
-		  "S" (a5)
-		: "cc", "memory");
+	//
+	// System calls with at most four parameters enter the kernel with
+	// sysenter, which is much cheaper than an interrupt.  sysenter
+	// saves no state, so we pass the return address in SI and the
+	// stack pointer in BP (saving BP on the stack first), and the
+	// kernel's sysexit hands them back in DX and CX, clobbering both.
+
+	if (a5 == 0) {
+		uint32_t edx, ecx;
+
+		asm volatile("pushl %%ebp\n"
+			"\tmovl %%esp, %%ebp\n"
+			"\tleal 1f, %%esi\n"
+			"\tsysenter\n"
+			"1:\tpopl %%ebp\n"
+			: "=a" (ret),
+			  "=d" (edx),
+			  "=c" (ecx)
+			: "a" (num),
+			  "d" (a1),
+			  "c" (a2),
+			  "b" (a3),
+			  "D" (a4)
+			: "esi", "cc", "memory");
+	} else
+		asm volatile("int %1\n"
+			: "=a" (ret)
+			: "i" (T_SYSCALL),
+			  "a" (num),
+			  "d" (a1),
+			  "c" (a2),
+			  "b" (a3),
+			  "D" (a4),
+			  "S" (a5)
+			: "cc", "memory");
 
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
@@ -100,7 +125,14 @@ sys_send_packet(void *srcva, size_t len)
 int
 sys_recv_packet(void *srcva, size_t *len_store)
 {
-	return syscall(SYS_recv_packet, 1, (uint32_t)srcva, (uint32_t)len_store, 0, 0, 0);
+	return syscall(SYS_recv_packet, 1, (uint32_t)srcva, (uint32_t)len_store, 1, 0, 0);
+}
+// Like sys_recv_packet, but returns -E_RXD_EMPTY rather than waiting
+// when no packet has arrived.
+int
+sys_try_recv_packet(void *srcva, size_t *len_store)
+{
+	return syscall(SYS_recv_packet, 0, (uint32_t)srcva, (uint32_t)len_store, 0, 0, 0);
 }
 int
 sys_env_set_status(envid_t envid, int status)
@@ -130,12 +162,32 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_sendv(envid_t envid, uint32_t value, void **srcvas, size_t npages,
+	      int perm)
+{
+	return syscall(SYS_ipc_sendv, 0, envid, value, (uint32_t) srcvas,
+		       npages, perm);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recvv(void *dstva, size_t npages)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t) dstva, npages, 0, 0, 0);
+}
+
 
 unsigned int
 sys_time_msec(void)
@@ -170,3 +222,51 @@ int
 sys_report_bad_packet(char* packet,bool label){
 	return syscall(SYS_report_bad_packet, 0,(uint32_t) packet,(uint32_t) label, 0, 0, 0);
 }
+
+int
+sys_env_set_priority(envid_t envid, int priority, uint32_t weight)
+{
+	return syscall(SYS_env_set_priority, 1, envid, priority, weight, 0, 0);
+}
+
+int
+sys_sleep_until(unsigned int msec)
+{
+	return syscall(SYS_sleep_until, 0, msec, 0, 0, 0, 0);
+}
+
+int
+sys_page_batch(const struct PageOp *ops, int n)
+{
+	return syscall(SYS_page_batch, 1, (uint32_t) ops, n, 0, 0, 0);
+}
+
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	return syscall(SYS_page_alloc_large, 0, envid, (uint32_t) va, perm, 0, 0);
+}
+
+int
+sys_doorbell_wait(void)
+{
+	return syscall(SYS_doorbell_wait, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_doorbell_ring(void *ring)
+{
+	return syscall(SYS_doorbell_ring, 0, (uint32_t) ring, 0, 0, 0, 0);
+}
+
+int
+sys_ring_register(void *ring, envid_t peer)
+{
+	return syscall(SYS_ring_register, 0, (uint32_t) ring, peer, 0, 0, 0);
+}
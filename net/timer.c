@@ -8,11 +8,8 @@ timer(envid_t ns_envid, uint32_t initial_to) {
 	binaryname = "ns_timer";
 
 	while (1) {
-		while((r = sys_time_msec()) < stop && r >= 0) {
-			sys_yield();
-		}
-		if (r < 0)
-			panic("sys_time_msec: %e", r);
+		if ((r = sys_sleep_until(stop)) < 0)
+			panic("sys_sleep_until: %e", r);
 
 		ipc_send(ns_envid, NSREQ_TIMER, 0, 0);
 
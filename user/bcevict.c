@@ -0,0 +1,120 @@
+// Push more blocks through the file server than its block cache holds,
+// so that it has to evict, dirty blocks included: write a file a
+// quarter of the cache's size, read every other file on the disk, write
+// a second file once the cache is full (which reads the superblock and
+// the bitmap), then check both files' contents, time reading the first
+// back, and check with the file server that blocks were evicted.
+
+#include <inc/lib.h>
+
+static char buf[BLKSIZE];
+
+static void
+writefile(const char *path, int nblocks, int pattern)
+{
+	int fd, r, i;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %e", path, fd);
+	for (i = 0; i < nblocks; i++) {
+		memset(buf, i ^ pattern, sizeof(buf));
+		if ((r = write(fd, buf, sizeof(buf))) != sizeof(buf))
+			panic("write %s: %e", path, r);
+	}
+	close(fd);
+}
+
+static void
+checkfile(const char *path, int nblocks, int pattern)
+{
+	int fd, r, i;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	for (i = 0; i < nblocks; i++) {
+		if ((r = readn(fd, buf, sizeof(buf))) != sizeof(buf))
+			panic("read %s: %e", path, r);
+		if (buf[0] != (char) (i ^ pattern)
+		    || buf[BLKSIZE - 1] != (char) (i ^ pattern))
+			panic("%s: block %d lost its contents", path, i);
+	}
+	close(fd);
+}
+
+static void
+readall(const char *path)
+{
+	int fd, r;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		;
+	if (r < 0)
+		panic("read %s: %e", path, r);
+	close(fd);
+}
+
+// Read every regular file in the root directory but 'skip'.
+// Returns the number of blocks read.
+static int
+readdisk(const char *skip)
+{
+	char path[MAXPATHLEN];
+	struct File f;
+	int fd, n, nblocks = 0;
+
+	if ((fd = open("/", O_RDONLY)) < 0)
+		panic("open /: %e", fd);
+	while ((n = readn(fd, &f, sizeof f)) == sizeof f) {
+		if (!f.f_name[0] || f.f_type != FTYPE_REG
+		    || strcmp(f.f_name, skip) == 0)
+			continue;
+		snprintf(path, sizeof(path), "/%s", f.f_name);
+		readall(path);
+		nblocks += ROUNDUP(f.f_size, BLKSIZE) / BLKSIZE;
+	}
+	if (n < 0)
+		panic("read /: %e", n);
+	close(fd);
+	return nblocks;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Fsret_cache_stat before, after;
+	unsigned start;
+	int nblocks, nread, r;
+
+	if ((r = fs_cache_stat(&before)) < 0)
+		panic("fs_cache_stat: %e", r);
+	nblocks = before.ret_npages / 4;
+
+	writefile("/bcevict-a", nblocks, 0);
+	nread = readdisk("bcevict-a");
+	if (nblocks + nread <= before.ret_npages)
+		panic("bcevict: %d blocks on disk can't fill a %d-block cache",
+		      nblocks + nread, before.ret_npages);
+	writefile("/bcevict-b", nblocks, 0xff);
+
+	start = sys_time_msec();
+	checkfile("/bcevict-a", nblocks, 0);
+	start = sys_time_msec() - start;
+	checkfile("/bcevict-b", nblocks, 0xff);
+
+	if ((r = fs_cache_stat(&after)) < 0)
+		panic("fs_cache_stat: %e", r);
+	if (after.ret_nevicted == before.ret_nevicted)
+		panic("bcevict: %d blocks went through the cache, none evicted",
+		      2 * nblocks + nread);
+	if (after.ret_ncached > after.ret_npages)
+		panic("bcevict: %d blocks cached, over the %d-block budget",
+		      after.ret_ncached, after.ret_npages);
+
+	// Leave the disk as we found it.
+	if ((r = remove("/bcevict-a")) < 0 || (r = remove("/bcevict-b")) < 0)
+		panic("remove: %e", r);
+	cprintf("bcevict: %d blocks read back intact in %u ms, %d evicted\n",
+		nblocks, start, after.ret_nevicted - before.ret_nevicted);
+}
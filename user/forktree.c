@@ -1,8 +1,15 @@
 // Fork a binary tree of processes and display their structure.
+// Then time fork() against the user-level ufork(), including the
+// copy-on-write faults the parent takes writing to its memory afterwards.
 
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define DEPTH 3
+#define NFORKS	32
+#define NTOUCH	16
+
+static char touch[NTOUCH * PGSIZE] __attribute__((aligned(PGSIZE)));
 
 void forktree(const char *cur);
 
@@ -30,9 +37,39 @@ forktree(const char *cur)
 	forkchild(cur, '1');
 }
 
+// Returns the average cycles for one fork of 'dofork', plus the
+// copy-on-write faults on NTOUCH pages that follow it.
+static uint32_t
+forklatency(envid_t (*dofork)(void))
+{
+	envid_t child;
+	uint64_t start, total = 0;
+	int i, j;
+
+	for (i = 0; i < NFORKS; i++) {
+		start = read_tsc();
+		if ((child = dofork()) < 0)
+			panic("fork: %e", child);
+		if (child == 0)
+			exit();
+		for (j = 0; j < NTOUCH; j++)
+			touch[j * PGSIZE]++;
+		total += read_tsc() - start;
+		wait(child);
+	}
+	return total / NFORKS;
+}
+
 void
 umain(int argc, char **argv)
 {
+	uint32_t kfork, uforkc;
+
 	forktree("");
+
+	kfork = forklatency(fork);
+	uforkc = forklatency(ufork);
+	cprintf("forktree: fork %u cycles, ufork %u cycles (%d pages touched)\n",
+		kfork, uforkc, NTOUCH);
 }
 
@@ -0,0 +1,49 @@
+// Measure file server throughput with many concurrent clients.
+// Forks clients that each make a series of small file reads, and
+// reports how many requests per second the file server completes.
+
+#include <inc/lib.h>
+
+#define NCLIENTS	16
+#define NREQS		100
+
+static char buf[512];
+
+static void
+client(void)
+{
+	int i, fd, r;
+
+	for (i = 0; i < NREQS; i++) {
+		if ((fd = open("/newmotd", O_RDONLY)) < 0)
+			panic("open /newmotd: %e", fd);
+		if ((r = read(fd, buf, sizeof(buf))) < 0)
+			panic("read /newmotd: %e", r);
+		close(fd);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t clients[NCLIENTS];
+	unsigned start, elapsed;
+	int i;
+
+	start = sys_time_msec();
+	for (i = 0; i < NCLIENTS; i++) {
+		if ((clients[i] = fork()) < 0)
+			panic("fork: %e", clients[i]);
+		if (clients[i] == 0) {
+			client();
+			exit();
+		}
+	}
+	for (i = 0; i < NCLIENTS; i++)
+		wait(clients[i]);
+	elapsed = sys_time_msec() - start;
+
+	// Each open/read/close is three file server requests.
+	cprintf("fsclients: %d clients, %u requests/s\n", NCLIENTS,
+		elapsed ? 3 * NCLIENTS * NREQS * 1000 / elapsed : 0);
+}
@@ -0,0 +1,59 @@
+// Measure file server request latency while CPU hogs are running.
+// Forks spin-style children that never yield, then times a series of
+// small file reads with and without them.
+
+#include <inc/lib.h>
+
+#define NHOGS		8
+#define NREQS		200
+
+static char buf[512];
+
+// Returns the average latency of one open/read/close, in microseconds.
+static unsigned
+measure(void)
+{
+	unsigned start, elapsed;
+	int i, fd, r;
+
+	start = sys_time_msec();
+	for (i = 0; i < NREQS; i++) {
+		if ((fd = open("/newmotd", O_RDONLY)) < 0)
+			panic("open /newmotd: %e", fd);
+		if ((r = read(fd, buf, sizeof(buf))) < 0)
+			panic("read /newmotd: %e", r);
+		close(fd);
+	}
+	elapsed = sys_time_msec() - start;
+	return elapsed * 1000 / NREQS;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t hogs[NHOGS];
+	unsigned idle, loaded, weighted;
+	int i;
+
+	idle = measure();
+
+	for (i = 0; i < NHOGS; i++) {
+		if ((hogs[i] = fork()) < 0)
+			panic("fork: %e", hogs[i]);
+		if (hogs[i] == 0)
+			while (1)
+				/* do nothing */;
+	}
+	loaded = measure();
+
+	// A hog with a larger weight should take a larger share of the
+	// CPU, but must not delay the file server any further.
+	sys_env_set_priority(hogs[0], ENV_PRIO_NORMAL, ENV_WEIGHT_MAX);
+	weighted = measure();
+
+	for (i = 0; i < NHOGS; i++)
+		sys_env_destroy(hogs[i]);
+
+	cprintf("fslatency: %u us idle, %u us with %d hogs, %u us with a weighted hog\n",
+		idle, loaded, NHOGS, weighted);
+}
@@ -0,0 +1,52 @@
+// Time large sequential file reads with and without the file server's
+// read-map path.  Reads /sh into a page-aligned buffer, which gets the
+// block cache pages mapped copy-on-write, then into the same buffer off
+// by one byte, which takes the copying FSREQ_READ path.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPASSES		20
+#define BUFPAGES	8
+
+static char buf[(BUFPAGES + 1) * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// Returns the average cycles per byte to read the whole file into 'dst'.
+static unsigned
+measure(int fd, char *dst)
+{
+	uint64_t start, bytes = 0;
+	int pass, r;
+
+	start = read_tsc();
+	for (pass = 0; pass < NPASSES; pass++) {
+		if ((r = seek(fd, 0)) < 0)
+			panic("seek: %e", r);
+		while ((r = readn(fd, dst, BUFPAGES * PGSIZE)) > 0)
+			bytes += r;
+		if (r < 0)
+			panic("read /sh: %e", r);
+	}
+	if (bytes == 0)
+		panic("/sh is empty");
+	return (read_tsc() - start) / bytes;
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned mapped, copied;
+	int fd;
+
+	if ((fd = open("/sh", O_RDONLY)) < 0)
+		panic("open /sh: %e", fd);
+
+	// Warm the file server's block cache.
+	measure(fd, buf);
+	mapped = measure(fd, buf);
+	copied = measure(fd, buf + 1);
+	close(fd);
+
+	cprintf("fsreadmap: %u cycles/byte mapped, %u cycles/byte copied\n",
+		mapped, copied);
+}
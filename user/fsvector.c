@@ -0,0 +1,58 @@
+// Time writing and reading back a 512KB file in large requests, which
+// go to the file server as vectored IPCs of up to IPC_MAXPAGES pages,
+// against doing it in requests of less than a page each.
+
+#include <inc/lib.h>
+
+#define FILESIZE	(512 * 1024)
+#define SMALL		(PGSIZE / 2)
+
+static char buf[FILESIZE] __attribute__((aligned(PGSIZE)));
+
+// Write buf to 'path' and read it back, 'chunk' bytes per call.
+// Returns the milliseconds taken.
+static unsigned
+measure(const char *path, size_t chunk)
+{
+	unsigned start;
+	int fd, r, i, n;
+
+	start = sys_time_msec();
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %e", path, fd);
+	for (i = 0; i < FILESIZE; i += r)
+		if ((r = write(fd, buf + i, MIN(chunk, FILESIZE - i))) <= 0)
+			panic("write %s: %e", path, r);
+	if ((r = seek(fd, 0)) < 0)
+		panic("seek %s: %e", path, r);
+	for (i = 0; i < FILESIZE; i += r) {
+		n = MIN(chunk, FILESIZE - i);
+		if ((r = read(fd, buf + i, n)) <= 0)
+			panic("read %s: %e", path, r);
+	}
+	start = sys_time_msec() - start;
+
+	for (i = 0; i < FILESIZE; i += PGSIZE)
+		if (*(int *) (buf + i) != i)
+			panic("%s: bad data at offset %d", path, i);
+	// Give the disk space back.
+	if ((r = ftruncate(fd, 0)) < 0)
+		panic("ftruncate %s: %e", path, r);
+	close(fd);
+	return start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned vectored, small;
+	int i;
+
+	for (i = 0; i < FILESIZE; i += PGSIZE)
+		*(int *) (buf + i) = i;
+
+	vectored = measure("/fsvector.big", FILESIZE);
+	small = measure("/fsvector.small", SMALL);
+	cprintf("fsvector: %u ms in large requests, %u ms in %d-byte requests\n",
+		vectored, small, SMALL);
+}
@@ -0,0 +1,55 @@
+// Measure what 4MB pages save in TLB misses.
+// Scans 4MB of memory mapped with 4KB pages, then 4MB mapped as a
+// single large page with sys_page_alloc_large, touching one word per
+// page.  A scan of the 4KB pages needs a thousand TLB entries, far
+// more than the TLB holds, so nearly every access misses; the large
+// page needs one.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define SMALLVA		0x10000000
+#define LARGEVA		(SMALLVA + PTSIZE)
+#define NPASSES		64
+
+// Returns the average cycles to touch each page of [va, va+PTSIZE) once.
+static unsigned
+scan(volatile uint32_t *va)
+{
+	uint64_t start;
+	uint32_t sum = 0;
+	int pass, i;
+
+	start = read_tsc();
+	for (pass = 0; pass < NPASSES; pass++)
+		for (i = 0; i < NPTENTRIES; i++)
+			sum += va[i * (PGSIZE / sizeof(uint32_t)) + pass];
+	if (sum != 0)
+		panic("fresh pages are not zero");
+	return (read_tsc() - start) / (NPASSES * NPTENTRIES);
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned small, large;
+	uintptr_t va;
+	int r;
+
+	for (va = SMALLVA; va < SMALLVA + PTSIZE; va += PGSIZE)
+		if ((r = page_batch_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("page_batch_alloc: %e", r);
+	if ((r = page_batch_flush()) < 0)
+		panic("page_batch_alloc: %e", r);
+	if ((r = sys_page_alloc_large(0, (void *) LARGEVA, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc_large: %e", r);
+
+	// Warm the caches the same way for both.
+	scan((uint32_t *) SMALLVA);
+	scan((uint32_t *) LARGEVA);
+	small = scan((uint32_t *) SMALLVA);
+	large = scan((uint32_t *) LARGEVA);
+
+	cprintf("largepage: %u cycles/page with 4KB pages, %u cycles/page with a 4MB page\n",
+		small, large);
+}
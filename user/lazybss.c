@@ -0,0 +1,45 @@
+// Check that a big bss and a big malloc chunk only take memory for
+// the pages that get touched.  Counts, through uvpt, how many pages
+// of each are allocated and how many are still only reserved.
+
+#include <inc/lib.h>
+
+#define NPAGES	512
+
+static char bss[NPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+count(const char *what, char *start, int npages)
+{
+	int i, present = 0, lazy = 0;
+	pte_t pte;
+
+	for (i = 0; i < npages; i++) {
+		pte = uvpt[PGNUM(start + i * PGSIZE)];
+		if (pte & PTE_P)
+			present++;
+		else if (pte & PTE_LAZY)
+			lazy++;
+	}
+	cprintf("lazybss: %s: %d pages allocated, %d reserved\n",
+		what, present, lazy);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char *heap;
+	int i;
+
+	for (i = 0; i < NPAGES; i += 16)
+		if (bss[i * PGSIZE] != 0)
+			panic("bss page %d is not zero", i);
+	bss[0] = 1;
+	count("bss", bss, NPAGES);
+
+	if (!(heap = malloc(NPAGES * PGSIZE / 4)))
+		panic("malloc failed");
+	heap[0] = 1;
+	count("malloc", ROUNDDOWN(heap, PGSIZE), NPAGES / 4);
+	free(heap);
+}
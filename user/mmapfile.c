@@ -0,0 +1,56 @@
+// Map /sh twice, read-only and copy-on-write, and check that both
+// mappings see the file's contents in the same physical pages, that a
+// write to the copy-on-write one stays private, and time how long it
+// takes to fault in each page.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define MAPVA		((char *) 0x30000000)
+#define COWVA		((char *) 0x38000000)
+
+static char buf[PGSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	struct Stat st;
+	uint64_t start;
+	unsigned cycles;
+	int fd, r, i, npages;
+
+	if ((fd = open("/sh", O_RDONLY)) < 0)
+		panic("open /sh: %e", fd);
+	if ((r = fstat(fd, &st)) < 0)
+		panic("fstat /sh: %e", r);
+	npages = ROUNDUP(st.st_size, PGSIZE) / PGSIZE;
+
+	if ((r = mmap(MAPVA, st.st_size, PTE_P|PTE_U, fd, 0)) < 0)
+		panic("mmap: %e", r);
+	if ((r = mmap(COWVA, st.st_size, PTE_P|PTE_U|PTE_W, fd, 0)) < 0)
+		panic("mmap: %e", r);
+
+	start = read_tsc();
+	for (i = 0; i < npages; i++)
+		(void) ((volatile char *) MAPVA)[i * PGSIZE];
+	cycles = (read_tsc() - start) / npages;
+
+	for (i = 0; (r = readn(fd, buf, sizeof(buf))) > 0; i += r) {
+		if (memcmp(MAPVA + i, buf, r) != 0 || memcmp(COWVA + i, buf, r) != 0)
+			panic("mapping differs from the file at offset %d", i);
+		if (PTE_ADDR(uvpt[PGNUM(MAPVA + i)]) != PTE_ADDR(uvpt[PGNUM(COWVA + i)]))
+			panic("mappings don't share the page at offset %d", i);
+	}
+	if (r < 0)
+		panic("read /sh: %e", r);
+	close(fd);
+
+	COWVA[0] = ~MAPVA[0];
+	if (COWVA[0] == MAPVA[0])
+		panic("copy-on-write mapping shares a write");
+
+	if ((r = munmap(MAPVA)) < 0 || (r = munmap(COWVA)) < 0)
+		panic("munmap: %e", r);
+	cprintf("mmapfile: %d pages shared, %u cycles to fault in each\n",
+		npages, cycles);
+}
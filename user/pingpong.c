@@ -1,12 +1,22 @@
 // Ping-pong a counter between two processes.
 // Only need to start one of these -- splits into two with fork.
+// Then time a run of silent round trips, each of which costs two
+// context switches when both processes share a CPU, next to as many
+// system calls that switch nothing, so that the switches' share (the
+// part global kernel pages make cheaper) shows.
 
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS	1000
 
 void
 umain(int argc, char **argv)
 {
 	envid_t who;
+	uint64_t start, trips;
+	bool first;
+	int n;
 
 	if ((who = fork()) != 0) {
 		// get the ball rolling
@@ -17,13 +27,37 @@ umain(int argc, char **argv)
 	while (1) {
 		uint32_t i = ipc_recv(&who, 0, 0);
 		cprintf("%x got %d from %x\n", sys_getenvid(), i, who);
-		if (i == 10)
-			return;
+		if (i == 10) {
+			first = true;
+			break;
+		}
 		i++;
 		ipc_send(who, i, 0, 0);
-		if (i == 10)
-			return;
+		if (i == 10) {
+			first = false;
+			break;
+		}
 	}
 
+	// Whoever got the last message serves first.
+	start = read_tsc();
+	for (n = 0; n < NROUNDS; n++) {
+		if (first) {
+			ipc_send(who, n, 0, 0);
+			ipc_recv(&who, 0, 0);
+		} else {
+			ipc_recv(&who, 0, 0);
+			ipc_send(who, n, 0, 0);
+		}
+	}
+	if (first) {
+		trips = read_tsc() - start;
+		// A round trip is two sends and two receives.
+		start = read_tsc();
+		for (n = 0; n < 4 * NROUNDS; n++)
+			sys_getenvid();
+		cprintf("pingpong: %u cycles per round trip, %u for 4 system calls\n",
+			(unsigned) (trips / NROUNDS),
+			(unsigned) ((read_tsc() - start) / NROUNDS));
+	}
 }
-
@@ -0,0 +1,50 @@
+// Compare the cost of reading file blocks that aren't cached yet in
+// order, which the file server reads ahead in multi-block IDE commands,
+// and in reverse, which defeats read-ahead and reads one block per
+// fault.  Uses two different files, so that neither is cached by the
+// other's pass.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+static char buf[BLKSIZE];
+
+// Returns the average cycles to read each block of 'path', going
+// forward or backward through the file.
+static unsigned
+measure(const char *path, bool forward)
+{
+	struct Stat st;
+	uint64_t start;
+	int fd, r, i, nblocks, bno;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	if ((r = fstat(fd, &st)) < 0)
+		panic("fstat %s: %e", path, r);
+	nblocks = st.st_size / BLKSIZE;
+	if (nblocks == 0)
+		panic("%s is too small", path);
+
+	start = read_tsc();
+	for (i = 0; i < nblocks; i++) {
+		bno = forward ? i : nblocks - 1 - i;
+		if ((r = seek(fd, bno * BLKSIZE)) < 0)
+			panic("seek %s: %e", path, r);
+		if ((r = readn(fd, buf, sizeof(buf))) != sizeof(buf))
+			panic("read %s: %e", path, r);
+	}
+	close(fd);
+	return (read_tsc() - start) / nblocks;
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned forward, backward;
+
+	forward = measure("/sh", 1);
+	backward = measure("/init", 0);
+	cprintf("readahead: %u cycles/block in order, %u cycles/block in reverse\n",
+		forward, backward);
+}
@@ -0,0 +1,55 @@
+// Compare streaming messages to another env with IPC, which costs a
+// rendezvous per message, against a shared-memory ring, where the
+// sender only enters the kernel to wake a receiver that ran dry.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NMSGS	10000
+
+static struct Ring ring __attribute__((aligned(PGSIZE)));
+
+void
+umain(int argc, char **argv)
+{
+	struct RingDesc d;
+	uint64_t start, tipc, tring;
+	envid_t child;
+	int i, r;
+
+	if ((r = ring_alloc(&ring)) < 0)
+		panic("ring_alloc: %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < NMSGS; i++)
+			if (ipc_recv(0, 0, 0) != i)
+				panic("ipc message %d out of order", i);
+		for (i = 0; i < NMSGS; i++) {
+			ring_pop(&ring, &d);
+			if (d.rd_value != i)
+				panic("ring message %d out of order", i);
+		}
+		return;
+	}
+	if ((r = ring_connect(&ring, child)) < 0)
+		panic("ring_connect: %e", r);
+
+	start = read_tsc();
+	for (i = 0; i < NMSGS; i++)
+		ipc_send(child, i, 0, 0);
+	tipc = read_tsc() - start;
+
+	start = read_tsc();
+	memset(&d, 0, sizeof(d));
+	for (i = 0; i < NMSGS; i++) {
+		d.rd_value = i;
+		ring_push(&ring, &d);
+	}
+	wait(child);
+	tring = read_tsc() - start;
+
+	cprintf("ringbench: %u cycles/message with IPC, %u with a ring\n",
+		(uint32_t) (tipc / NMSGS), (uint32_t) (tring / NMSGS));
+}
@@ -2,13 +2,27 @@
 
 volatile int counter;
 
+#define NYIELDS	1000
+
+// Milliseconds the parent took for NYIELDS yields with nothing else of
+// ours to run, measured before forking: the baseline for the children's
+// contended yields.
+unsigned solo;
+
 void
 umain(int argc, char **argv)
 {
 	int i, j;
 	int seen;
+	int cpu, migrations;
+	unsigned start, elapsed;
 	envid_t parent = sys_getenvid();
 
+	start = sys_time_msec();
+	for (i = 0; i < NYIELDS; i++)
+		sys_yield();
+	solo = sys_time_msec() - start;
+
 	// Fork several environments
 	for (i = 0; i < 20; i++)
 		if (fork() == 0)
@@ -35,5 +49,24 @@ umain(int argc, char **argv)
 	// Check that we see environments running on different CPUs
 	cprintf("[%08x] stresssched on CPU %d\n", thisenv->env_id, thisenv->env_cpunum);
 
+	// Measure scheduling throughput: how fast we get through a run
+	// of yields, and how often we were moved to another CPU.
+	migrations = 0;
+	cpu = thisenv->env_cpunum;
+	start = sys_time_msec();
+	for (i = 0; i < NYIELDS; i++) {
+		sys_yield();
+		if (thisenv->env_cpunum != cpu) {
+			cpu = thisenv->env_cpunum;
+			migrations++;
+		}
+	}
+	elapsed = sys_time_msec() - start;
+	cprintf("[%08x] stresssched: %d yields in %u ms (%u/s; %u ms alone), "
+		"%d of %d yields migrated\n",
+		thisenv->env_id, NYIELDS, elapsed,
+		elapsed ? NYIELDS * 1000 / elapsed : 0, solo,
+		migrations, NYIELDS);
+
 }
 
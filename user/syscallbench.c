@@ -0,0 +1,65 @@
+// Measure system call throughput as more envs make calls in parallel.
+// Each worker allocates and unmaps a private page over and over, which
+// takes the page allocator and env locks but not the big kernel lock.
+
+#include <inc/lib.h>
+
+#define MAXWORKERS	8
+#define NOPS		5000
+
+static void
+worker(void)
+{
+	void *va = (void *) (UTEXT + PTSIZE * 4);
+	int i, r;
+
+	// Wait for the go signal so all workers start together.
+	ipc_recv(0, 0, 0);
+	for (i = 0; i < NOPS; i++) {
+		if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("sys_page_unmap: %e", r);
+	}
+	ipc_send(thisenv->env_parent_id, 0, 0, 0);
+}
+
+// Returns the number of milliseconds 'n' workers take to finish.
+static unsigned
+run(int n)
+{
+	envid_t workers[MAXWORKERS];
+	unsigned start;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if ((workers[i] = fork()) < 0)
+			panic("fork: %e", workers[i]);
+		if (workers[i] == 0) {
+			worker();
+			exit();
+		}
+	}
+
+	start = sys_time_msec();
+	for (i = 0; i < n; i++)
+		ipc_send(workers[i], 0, 0, 0);
+	for (i = 0; i < n; i++)
+		ipc_recv(0, 0, 0);
+	return sys_time_msec() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned ms;
+	int n;
+
+	for (n = 1; n <= MAXWORKERS; n *= 2) {
+		ms = run(n);
+		if (ms == 0)
+			ms = 1;
+		cprintf("syscallbench: %d envs: %d syscalls in %u ms (%u/ms)\n",
+			n, n * NOPS * 2, ms, n * NOPS * 2 / ms);
+	}
+}
@@ -0,0 +1,29 @@
+// Measure the cycle cost of a system call that takes the big kernel
+// lock, next to one that does not.  The locked call returns to the
+// caller through trap(), so this tracks the cost of that return path.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALLS	100000
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, tlocked, tnolock;
+	int i, r;
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		if ((r = sys_env_set_priority(0, ENV_PRIO_NORMAL, ENV_WEIGHT_DEFAULT)) < 0)
+			panic("sys_env_set_priority: %e", r);
+	tlocked = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		sys_getenvid();
+	tnolock = read_tsc() - start;
+
+	cprintf("syscallcost: %u cycles/call with the kernel lock, %u without\n",
+		(uint32_t) (tlocked / NCALLS), (uint32_t) (tnolock / NCALLS));
+}
@@ -0,0 +1,44 @@
+// Compare the cost of entering the kernel with int $T_SYSCALL and
+// with sysenter, using sys_getenvid as the cheapest system call.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALLS	100000
+
+static envid_t
+getenvid_int(void)
+{
+	envid_t ret;
+
+	asm volatile("int %1\n"
+		: "=a" (ret)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_getenvid),
+		  "d" (0), "c" (0), "b" (0), "D" (0), "S" (0)
+		: "cc", "memory");
+	return ret;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, tint, tsysenter;
+	int i;
+
+	if (getenvid_int() != sys_getenvid())
+		panic("int and sysenter disagree on the envid");
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		getenvid_int();
+	tint = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		sys_getenvid();
+	tsysenter = read_tsc() - start;
+
+	cprintf("sysenterbench: int %u cycles/call, sysenter %u cycles/call\n",
+		(uint32_t) (tint / NCALLS), (uint32_t) (tsysenter / NCALLS));
+}
@@ -0,0 +1,34 @@
+// Measure the per-packet cost of checking a network buffer.
+// Polls an idle receive ring with sys_try_recv_packet, which checks
+// the whole packet buffer with user_mem_check before finding the ring
+// empty and returning, next to sys_getenvid, which checks nothing.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALLS	100000
+
+// Straddles a page boundary, as packet buffers often do.
+static char buf[2 * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, trecv, tnone;
+	size_t len;
+	int i;
+
+	memset(buf, 0, sizeof(buf));
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		sys_try_recv_packet(buf + PGSIZE - 64, &len);
+	trecv = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		sys_getenvid();
+	tnone = read_tsc() - start;
+
+	cprintf("umemcheck: %u cycles/call for sys_try_recv_packet, %u for sys_getenvid\n",
+		(uint32_t) (trecv / NCALLS), (uint32_t) (tnone / NCALLS));
+}